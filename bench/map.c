@@ -0,0 +1,153 @@
+// Pair counting micro-benchmark: counts every adjacent byte pair of a file the
+// way bpe.c does, once through each table chaos.h offers and once through the
+// chained chaos_Table chaos.h had before chaos_Map, kept here as the baseline.
+//
+//   gcc -O2 -I. -o bench_map bench/map.c
+//   ./bench_map <file> [rounds]
+
+#define CHAOS_IMPLEMENTATION
+#include <chaos.h>
+
+typedef struct {
+  int *items;
+  size_t count;
+  size_t capacity;
+} Tokens;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// The old chaos_Table: 16 buckets that never grow, each a list of strdup'ed
+// strings searched front to back
+typedef struct {
+  uint32_t key;
+  char *value;
+  size_t freq;
+} Chained_KV;
+
+typedef struct {
+  Chained_KV *items;
+  size_t count;
+  size_t capacity;
+} Chained_Bucket;
+
+typedef struct {
+  Chained_Bucket *items;
+  size_t count;
+} Chained_Table;
+
+static void chained_append(Chained_Table *t, char *value, size_t len) {
+  if (t->items == NULL) {
+    t->count = 16;
+    t->items = calloc(t->count, sizeof(Chained_Bucket));
+    CHAOS_ASSERT(t->items != NULL && "Buy more RAM lol");
+  }
+
+  uint32_t key = djb33_hash(value, len);
+  Chained_Bucket *bucket = &t->items[key % t->count];
+  for (size_t i = 0; i < bucket->count; ++i) {
+    Chained_KV *kv = &bucket->items[i];
+    if (kv->key == key && strcmp(kv->value, value) == 0) {
+      kv->freq++;
+      return;
+    }
+  }
+  da_append(bucket, ((Chained_KV){
+                        .key = key,
+                        .value = strdup(value),
+                        .freq = 1,
+                    }));
+}
+
+static size_t count_chained(Tokens *tokens) {
+  Chained_Table tb = {0};
+  for (size_t i = 0; i + 1 < tokens->count; ++i) {
+    char *key = temp_sprintf("%03d%03d", tokens->items[i], tokens->items[i + 1]);
+    chained_append(&tb, key, 6);
+  }
+  size_t distinct = 0;
+  for (size_t b = 0; b < tb.count; ++b) {
+    distinct += tb.items[b].count;
+    for (size_t i = 0; i < tb.items[b].count; ++i) {
+      free(tb.items[b].items[i].value);
+    }
+    free(tb.items[b].items);
+  }
+  free(tb.items);
+  return distinct;
+}
+
+// What bpe.c used to do: format every pair as a string key
+static size_t count_table(Tokens *tokens) {
+  Table tb = {0};
+  for (size_t i = 0; i + 1 < tokens->count; ++i) {
+    char *key = temp_sprintf("%03d%03d", tokens->items[i], tokens->items[i + 1]);
+    table_append(&tb, key, 6);
+  }
+  size_t distinct = tb.map.count;
+  table_free(&tb);
+  return distinct;
+}
+
+static size_t count_map(Tokens *tokens) {
+  Map m = map_of(uint64_t, size_t, NULL, NULL);
+  for (size_t i = 0; i + 1 < tokens->count; ++i) {
+    uint64_t key = pair_key(tokens->items[i], tokens->items[i + 1]);
+    (*(size_t *)map_value(&m, map_insert(&m, &key, NULL)))++;
+  }
+  size_t distinct = m.count;
+  map_free(&m);
+  return distinct;
+}
+
+static size_t count_pair_table(Tokens *tokens) {
+  Pair_Table pt = {0};
+  for (size_t i = 0; i + 1 < tokens->count; ++i) {
+    *pair_table_at(&pt, pair_key(tokens->items[i], tokens->items[i + 1])) += 1;
+  }
+  size_t distinct = pt.count;
+  pair_table_free(&pt);
+  return distinct;
+}
+
+static void run(const char *name, size_t (*count)(Tokens *), Tokens *tokens, int rounds) {
+  size_t distinct = 0;
+  double best = 0;
+
+  for (int r = 0; r < rounds; ++r) {
+    double start = now();
+    distinct = count(tokens);
+    double elapsed = now() - start;
+    if (r == 0 || elapsed < best) best = elapsed;
+  }
+
+  size_t pairs = tokens->count ? tokens->count - 1 : 0;
+  printf("%-16s %10zu distinct %10.3f ms %8.2f ns/pair\n", name, distinct,
+         best * 1e3, pairs ? best * 1e9 / pairs : 0.0);
+}
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage %s <file> [rounds]\n", argv[0]);
+    return 1;
+  }
+  int rounds = argc > 2 ? atoi(argv[2]) : 5;
+
+  String_Builder sb = {0};
+  if (!read_file(argv[1], &sb)) return 1;
+
+  Tokens tokens = {0};
+  for (size_t i = 0; i < sb.count; ++i) {
+    da_append(&tokens, (unsigned char)sb.items[i]);
+  }
+
+  printf("%zu pairs, best of %d rounds\n", tokens.count ? tokens.count - 1 : 0, rounds);
+  run("chained (old)", count_chained, &tokens, rounds);
+  run("chaos_Table", count_table, &tokens, rounds);
+  run("chaos_Map", count_map, &tokens, rounds);
+  run("chaos_Pair_Table", count_pair_table, &tokens, rounds);
+  return 0;
+}
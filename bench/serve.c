@@ -0,0 +1,291 @@
+// Load generator for `bpe serve`: sends the lines of a file as encode
+// requests over several connections at once and reports the throughput and
+// latency seen by the clients, next to the server's own counters.
+//
+//   gcc -O2 -I. -o bench_serve bench/serve.c -lpthread
+//   ./bench_serve [--socket path | --port N] [--connections N]
+//                 [--requests N] [--check] <file>
+//
+// Connection c sends lines c, c + connections, ... wrapping around the file
+// until it has made its share of the requests. With --check every answer is
+// decoded by the server again and compared with the line it came from.
+
+#define CHAOS_IMPLEMENTATION
+#include <chaos.h>
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// The protocol of `bpe serve`, see bpe.c
+enum { SERVE_ENCODE, SERVE_DECODE, SERVE_STATS };
+
+typedef struct {
+  String_View *items;
+  size_t count;
+  size_t capacity;
+} Views;
+
+typedef struct {
+  double *items;
+  size_t count;
+  size_t capacity;
+} Latencies;
+
+typedef struct {
+  char *socket_path;
+  long port;
+  bool check;
+  Views *lines;
+  size_t id;
+  size_t connections;
+  size_t requests;
+  Latencies latencies;
+  size_t bytes;
+  size_t tokens;
+  bool ok;
+} Client;
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static bool read_all(int fd, void *data, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t n = read(fd, (char *)data + done, size - done);
+    if (n <= 0 && !(n < 0 && errno == EINTR))
+      return false;
+    if (n > 0)
+      done += n;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const void *data, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t n = send(fd, (const char *)data + done, size - done, MSG_NOSIGNAL);
+    if (n < 0 && errno != EINTR)
+      return false;
+    if (n > 0)
+      done += n;
+  }
+  return true;
+}
+
+static int connect_to(char *socket_path, long port) {
+  int fd = -1;
+  if (socket_path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", socket_path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  } else {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons((uint16_t)port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int one = 1;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      close(fd);
+      fd = -1;
+    }
+    if (fd >= 0)
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  if (fd < 0)
+    fprintf(stderr, "Cannot connect: %s\n", strerror(errno));
+  return fd;
+}
+
+// Sends one request and reads the answer into reply, false when the
+// connection broke or the server refused it
+static bool request(int fd, uint32_t op, const void *data, size_t size,
+                    String_Builder *reply) {
+  uint32_t header[2] = {op, (uint32_t)size};
+  if (!write_all(fd, header, sizeof(header)) || !write_all(fd, data, size) ||
+      !read_all(fd, header, sizeof(header)))
+    return false;
+  reply->count = 0;
+  da_reserve(reply, header[1] + 1);
+  if (!read_all(fd, reply->items, header[1]))
+    return false;
+  reply->count = header[1];
+  return header[0] == 0;
+}
+
+static void *client_run(void *arg) {
+  Client *c = arg;
+  int fd = connect_to(c->socket_path, c->port);
+  if (fd < 0)
+    return NULL;
+
+  String_Builder reply = {0};
+  String_Builder decoded = {0};
+  c->ok = true;
+  for (size_t k = 0; c->ok && k < c->requests; ++k) {
+    String_View *line = &c->lines->items[(c->id + k * c->connections) %
+                                          c->lines->count];
+    double start = now();
+    c->ok = request(fd, SERVE_ENCODE, line->data, line->count, &reply);
+    da_append(&c->latencies, now() - start);
+    c->bytes += line->count;
+    c->tokens += reply.count / sizeof(uint32_t);
+
+    if (c->ok && c->check) {
+      c->ok = request(fd, SERVE_DECODE, reply.items, reply.count, &decoded) &&
+              decoded.count == line->count &&
+              memcmp(decoded.items, line->data, line->count) == 0;
+      if (!c->ok)
+        fprintf(stderr, "Round trip failed on line %zu\n",
+                (c->id + k * c->connections) % c->lines->count);
+    }
+  }
+
+  close(fd);
+  free(reply.items);
+  free(decoded.items);
+  return NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// The value after option i, a whole number of at least min
+static bool int_option(int argc, char **argv, int *i, long min, long *out) {
+  if (*i + 1 >= argc || !is_int(argv[*i + 1]) || atol(argv[*i + 1]) < min)
+    return false;
+  *out = atol(argv[++*i]);
+  return true;
+}
+
+static void usage(const char *program) {
+  fprintf(stderr,
+          "Usage %s [--socket path | --port N] [--connections N] "
+          "[--requests N] [--check] <file>\n",
+          program);
+}
+
+int main(int argc, char **argv) {
+  char *socket_path = NULL;
+  char *file = NULL;
+  long port = 0;
+  long connections = 8;
+  long requests = 100000;
+  bool check = false;
+
+  for (int i = 1; i < argc; ++i) {
+    bool ok = true;
+    if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (strcmp(argv[i], "--port") == 0) {
+      ok = int_option(argc, argv, &i, 1, &port) && port <= 65535;
+    } else if (strcmp(argv[i], "--connections") == 0) {
+      ok = int_option(argc, argv, &i, 1, &connections);
+    } else if (strcmp(argv[i], "--requests") == 0) {
+      ok = int_option(argc, argv, &i, 1, &requests);
+    } else if (strcmp(argv[i], "--check") == 0) {
+      check = true;
+    } else if (!file && argv[i][0] != '-') {
+      file = argv[i];
+    } else {
+      ok = false;
+    }
+
+    if (!ok) {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!file || (socket_path && port)) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (!port && !socket_path)
+    socket_path = "bpe.sock";
+
+  String_View text = {0};
+  if (!map_file(file, &text))
+    return 1;
+  Views lines = {0};
+  for (size_t i = 0; i < text.count;) {
+    const char *nl = memchr(text.data + i, '\n', text.count - i);
+    size_t end = nl ? (size_t)(nl - text.data) + 1 : text.count;
+    da_append(&lines, sv_from_parts(text.data + i, end - i));
+    i = end;
+  }
+  if (lines.count == 0) {
+    fprintf(stderr, "Nothing to send in <%s>\n", file);
+    return 1;
+  }
+
+  Client *clients = calloc(connections, sizeof(*clients));
+  pthread_t *threads = calloc(connections, sizeof(*threads));
+  CHAOS_ASSERT(clients != NULL && threads != NULL && "Buy more RAM lol");
+  double start = now();
+  for (long k = 0; k < connections; ++k) {
+    clients[k] = (Client){
+        .socket_path = socket_path,
+        .port = port,
+        .check = check,
+        .lines = &lines,
+        .id = k,
+        .connections = connections,
+        .requests = requests / connections + (k < requests % connections),
+    };
+    pthread_create(&threads[k], NULL, client_run, &clients[k]);
+  }
+
+  Latencies all = {0};
+  size_t bytes = 0, tokens = 0;
+  bool ok = true;
+  for (long k = 0; k < connections; ++k) {
+    pthread_join(threads[k], NULL);
+    ok = ok && clients[k].ok;
+    bytes += clients[k].bytes;
+    tokens += clients[k].tokens;
+    for (size_t i = 0; i < clients[k].latencies.count; ++i) {
+      da_append(&all, clients[k].latencies.items[i]);
+    }
+    free(clients[k].latencies.items);
+  }
+  double elapsed = now() - start;
+
+  qsort(all.items, all.count, sizeof(*all.items), compare_doubles);
+  double p50 = all.count ? all.items[(all.count - 1) / 2] : 0;
+  double p99 = all.count ? all.items[(all.count - 1) * 99 / 100] : 0;
+  printf("Sent %zu requests over %ld connections in %.3f s\n", all.count,
+         connections, elapsed);
+  printf("%.0f req/s, %.2f MB/s, %.0f tokens/s\n", all.count / elapsed,
+         bytes / elapsed / 1e6, tokens / elapsed);
+  printf("Latency p50 %.3f ms, p99 %.3f ms\n", p50 * 1e3, p99 * 1e3);
+
+  // The server's side of the same window
+  int fd = connect_to(socket_path, port);
+  String_Builder reply = {0};
+  if (fd >= 0 && request(fd, SERVE_STATS, NULL, 0, &reply))
+    printf("Server: %.*s\n", (int)reply.count, reply.items);
+  if (fd >= 0)
+    close(fd);
+  if (check)
+    printf("Round trip: %s\n", ok ? "ok" : "FAILED");
+
+  free(reply.items);
+  free(all.items);
+  free(clients);
+  free(threads);
+  free(lines.items);
+  unmap_file(&text);
+  return ok ? 0 : 1;
+}
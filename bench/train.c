@@ -0,0 +1,467 @@
+// Training benchmark: builds deterministic corpora of Zipf distributed words
+// (or takes real files) and times training, encoding and decoding each of
+// them through bpe.h, with libbpe.c compiled in. Every phase reports its
+// throughput, the peak RSS so far and the heap allocations it made, as CSV or
+// JSON lines, so two versions can be compared run against run.
+//
+//   gcc -O2 -I. -o bench_train bench/train.c -lpthread -lm
+//   ./bench_train [--sizes 1,16,256] [--words] [--threads N] [--vocab-size N]
+//                 [--seed N] [--json] [-o results] [file...]
+//
+// Sizes are in MB. Each corpus runs in a child process so its peak RSS is
+// its own. Allocations are counted by routing libbpe.c's malloc, calloc and
+// realloc through counters, a realloc counts as one allocation.
+
+// Everything libbpe.c pulls in comes first, so only its own calls get counted
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+static size_t allocs = 0;
+static size_t alloc_bytes = 0;
+
+static void count_alloc(size_t n) {
+  __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&alloc_bytes, n, __ATOMIC_RELAXED);
+}
+
+static void *bench_malloc(size_t n) {
+  count_alloc(n);
+  return malloc(n);
+}
+
+static void *bench_calloc(size_t count, size_t size) {
+  count_alloc(count * size);
+  return calloc(count, size);
+}
+
+static void *bench_realloc(void *ptr, size_t n) {
+  count_alloc(n);
+  return realloc(ptr, n);
+}
+
+#define malloc(n) bench_malloc(n)
+#define calloc(count, size) bench_calloc(count, size)
+#define realloc(ptr, n) bench_realloc(ptr, n)
+#include "../libbpe.c"
+#undef malloc
+#undef calloc
+#undef realloc
+
+#define ZIPF_WORDS 50000
+#define ZIPF_EXPONENT 1.07
+
+typedef struct {
+  size_t *items;
+  size_t count;
+  size_t capacity;
+} Sizes;
+
+typedef struct {
+  Sizes sizes;
+  Paths files;
+  bool json;
+  uint64_t seed;
+  Bpe_Options options;
+  FILE *out;
+} Bench;
+
+// splitmix64, the same seed gives the same corpus everywhere
+static uint64_t rng_next(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+  return z ^ (z >> 31);
+}
+
+static double rng_unit(uint64_t *state) {
+  return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Fills sb with size bytes of text: ZIPF_WORDS made up words of 1 to 12
+// letters, drawn by rank with weight 1/rank^ZIPF_EXPONENT and separated by
+// spaces, with the odd punctuation mark and line break thrown in.
+static void corpus_generate(String_Builder *sb, size_t size, uint64_t seed) {
+  uint64_t state = seed;
+  char (*words)[13] = malloc(sizeof(*words) * ZIPF_WORDS);
+  double *cdf = malloc(sizeof(*cdf) * ZIPF_WORDS);
+  CHAOS_ASSERT(words != NULL && cdf != NULL && "Buy more RAM lol");
+
+  // Short words are the common ones, like in real text
+  static const char letters[] = "etaoinshrdlcumwfgypbvkjxqz";
+  double total = 0;
+  for (size_t w = 0; w < ZIPF_WORDS; ++w) {
+    size_t len = 1 + (w < 100 ? rng_next(&state) % 4 : rng_next(&state) % 12);
+    for (size_t i = 0; i < len; ++i) {
+      double u = rng_unit(&state);
+      words[w][i] = letters[(size_t)(u * u * 26)];
+    }
+    words[w][len] = '\0';
+    total += 1.0 / pow(w + 1, ZIPF_EXPONENT);
+    cdf[w] = total;
+  }
+
+  da_reserve(sb, size + 16);
+  while (sb->count < size) {
+    double u = rng_unit(&state) * total;
+    size_t lo = 0, hi = ZIPF_WORDS - 1;
+    while (lo < hi) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (cdf[mid] < u)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+
+    size_t len = strlen(words[lo]);
+    if (sb->count + len + 2 > size)
+      break;
+    memcpy(sb->items + sb->count, words[lo], len);
+    sb->count += len;
+
+    uint64_t r = rng_next(&state) % 64;
+    if (r == 0)
+      sb->items[sb->count++] = '.';
+    else if (r == 1)
+      sb->items[sb->count++] = ',';
+    sb->items[sb->count++] = r == 2 ? '\n' : ' ';
+  }
+  while (sb->count < size)
+    sb->items[sb->count++] = '\n';
+
+  free(cdf);
+  free(words);
+}
+
+static long peak_rss_kb(void) {
+  struct rusage ru;
+  getrusage(RUSAGE_SELF, &ru);
+  return ru.ru_maxrss;
+}
+
+typedef struct {
+  const char *phase;
+  double seconds;
+  size_t bytes;
+  size_t merges;
+  size_t tokens;
+  size_t allocs;
+  size_t alloc_bytes;
+} Result;
+
+static void report(Bench *b, const char *corpus, Result *r) {
+  double mb_s = r->seconds > 0 ? r->bytes / r->seconds / 1e6 : 0.0;
+  double merges_s = r->seconds > 0 ? r->merges / r->seconds : 0.0;
+  if (b->json) {
+    fprintf(b->out,
+            "{\"corpus\":\"%s\",\"phase\":\"%s\",\"bytes\":%zu,"
+            "\"seconds\":%.6f,\"mb_per_s\":%.3f,\"merges\":%zu,"
+            "\"merges_per_s\":%.1f,\"tokens\":%zu,\"peak_rss_kb\":%ld,"
+            "\"allocs\":%zu,\"alloc_bytes\":%zu}\n",
+            corpus, r->phase, r->bytes, r->seconds, mb_s, r->merges, merges_s,
+            r->tokens, peak_rss_kb(), r->allocs, r->alloc_bytes);
+  } else {
+    fprintf(b->out, "%s,%s,%zu,%.6f,%.3f,%zu,%.1f,%zu,%ld,%zu,%zu\n", corpus,
+            r->phase, r->bytes, r->seconds, mb_s, r->merges, merges_s,
+            r->tokens, peak_rss_kb(), r->allocs, r->alloc_bytes);
+  }
+  fflush(b->out);
+}
+
+static void phase_begin(Result *r, const char *phase, double *start) {
+  *r = (Result){.phase = phase};
+  allocs = 0;
+  alloc_bytes = 0;
+  *start = now();
+}
+
+static void phase_end(Result *r, double start) {
+  r->seconds = now() - start;
+  r->allocs = allocs;
+  r->alloc_bytes = alloc_bytes;
+}
+
+// Trains on text the way `bpe train` does, then encodes and decodes it with
+// the model read back from disk, all through bpe.h
+static bool bench_corpus(Bench *b, const char *corpus, String_View text) {
+  Bpe *bpe = NULL;
+  if (bpe_create(&b->options, &bpe) != BPE_OK)
+    return false;
+  Result r;
+  double start;
+
+  phase_begin(&r, "train", &start);
+  Bpe_Train_Result trained = {0};
+  Bpe_Status status = bpe_train(bpe, text.data, text.count, &trained);
+  phase_end(&r, start);
+  if (status != BPE_OK) {
+    fprintf(stderr, "Training failed on <%s>: %s\n", corpus,
+            bpe_status_name(status));
+    bpe_free(bpe);
+    return false;
+  }
+  r.bytes = text.count;
+  r.merges = trained.merges;
+  r.tokens = trained.tokens;
+  report(b, corpus, &r);
+
+  const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  char *path = strdup(temp_sprintf("%s/bench_train_%d.bpe", dir, getpid()));
+  bool ok = bpe_save(bpe, path) == BPE_OK && bpe_load(bpe, path) == BPE_OK;
+  unlink(path);
+  free(path);
+  if (!ok) {
+    bpe_free(bpe);
+    return false;
+  }
+
+  // Never more tokens than bytes, so these fit whatever the model
+  uint32_t *tokens = malloc((text.count ? text.count : 1) * sizeof(*tokens));
+  char *decoded = malloc(text.count ? text.count : 1);
+  CHAOS_ASSERT(tokens != NULL && decoded != NULL && "Buy more RAM lol");
+  size_t count = 0;
+  phase_begin(&r, "encode", &start);
+  status = bpe_encode(bpe, text.data, text.count, tokens, text.count, &count);
+  phase_end(&r, start);
+  if (status == BPE_OK) {
+    r.bytes = text.count;
+    r.tokens = count;
+    report(b, corpus, &r);
+
+    size_t size = 0;
+    phase_begin(&r, "decode", &start);
+    status = bpe_decode(bpe, tokens, count, decoded, text.count, &size);
+    phase_end(&r, start);
+    if (status == BPE_OK) {
+      r.bytes = size;
+      r.tokens = count;
+      report(b, corpus, &r);
+      ok = size == text.count && memcmp(decoded, text.data, text.count) == 0;
+      if (!ok)
+        fprintf(stderr, "Round trip failed on <%s>\n", corpus);
+    }
+  }
+  if (status != BPE_OK) {
+    fprintf(stderr, "Encoding or decoding failed on <%s>: %s\n", corpus,
+            bpe_status_name(status));
+    ok = false;
+  }
+
+  free(decoded);
+  free(tokens);
+  bpe_free(bpe);
+  return ok;
+}
+
+// Special tokens b and b...bc, the long one OVERLAP_LONG bytes, over
+// OVERLAP_SIZE bytes of b. Every byte could start the long token until
+// OVERLAP_LONG bytes later, so a search that backs up to the end of each match
+// is quadratic. The answer must be one short token per byte.
+#define OVERLAP_LONG 2000
+#define OVERLAP_SIZE (2 << 20)
+
+static bool bench_overlap(Bench *b) {
+  char *text = malloc(OVERLAP_SIZE);
+  char *token = malloc(OVERLAP_LONG + 1);
+  uint32_t *tokens = malloc(OVERLAP_SIZE * sizeof(*tokens));
+  CHAOS_ASSERT(text != NULL && token != NULL && tokens != NULL &&
+               "Buy more RAM lol");
+  memset(text, 'b', OVERLAP_SIZE);
+  memset(token, 'b', OVERLAP_LONG - 1);
+  token[OVERLAP_LONG - 1] = 'c';
+  token[OVERLAP_LONG] = '\0';
+  const char *specials[] = {"b", token};
+  b->options.specials = specials;
+  b->options.special_count = 2;
+
+  Bpe *bpe = NULL;
+  Bpe_Train_Result trained = {0};
+  Bpe_Info info = {0};
+  bool ok = bpe_create(&b->options, &bpe) == BPE_OK &&
+            bpe_train(bpe, text, OVERLAP_SIZE, &trained) == BPE_OK &&
+            bpe_info(bpe, &info) == BPE_OK;
+  if (ok) {
+    Result r;
+    double start;
+    size_t count = 0;
+    phase_begin(&r, "encode", &start);
+    ok = bpe_encode(bpe, text, OVERLAP_SIZE, tokens, OVERLAP_SIZE, &count) ==
+         BPE_OK;
+    phase_end(&r, start);
+    uint32_t short_id = info.vocab_size - info.specials;
+    ok = ok && count == OVERLAP_SIZE;
+    for (size_t i = 0; ok && i < OVERLAP_SIZE; ++i) {
+      ok = tokens[i] == short_id;
+    }
+    if (ok) {
+      r.bytes = OVERLAP_SIZE;
+      r.tokens = count;
+      report(b, "specials-overlap", &r);
+    }
+  }
+  if (!ok)
+    fprintf(stderr, "Special tokens came out wrong on <specials-overlap>\n");
+
+  bpe_free(bpe);
+  free(tokens);
+  free(token);
+  free(text);
+  return ok;
+}
+
+// Runs one corpus in a child, synthetic when file is NULL, and the
+// overlapping special tokens when mb is 0 too
+static bool bench_fork(Bench *b, size_t mb, char *file) {
+  fflush(b->out);
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Cannot fork: %s\n", strerror(errno));
+    return false;
+  }
+  if (pid == 0) {
+    bool ok = false;
+    if (file) {
+      String_View text = {0};
+      if (map_file(file, &text)) {
+        ok = bench_corpus(b, file, text);
+        unmap_file(&text);
+      }
+    } else if (mb == 0) {
+      ok = bench_overlap(b);
+    } else {
+      String_Builder sb = {0};
+      corpus_generate(&sb, mb << 20, b->seed);
+      char *name = temp_sprintf("zipf-%zuMB", mb);
+      ok = bench_corpus(b, name, sv_from_parts(sb.items, sb.count));
+      free(sb.items);
+    }
+    fflush(b->out);
+    _exit(ok ? 0 : 1);
+  }
+
+  int status = 0;
+  waitpid(pid, &status, 0);
+  return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool parse_sizes(char *list, Sizes *sizes) {
+  sizes->count = 0;
+  for (char *p = list; *p;) {
+    char *end = NULL;
+    long mb = strtol(p, &end, 10);
+    if (end == p || mb <= 0 || (*end != ',' && *end != '\0'))
+      return false;
+    da_append(sizes, (size_t)mb);
+    p = *end ? end + 1 : end;
+  }
+  return sizes->count > 0;
+}
+
+// The value after option i, a whole number of at least min
+static bool int_option(int argc, char **argv, int *i, long min, long *out) {
+  if (*i + 1 >= argc || !is_int(argv[*i + 1]) || atol(argv[*i + 1]) < min)
+    return false;
+  *out = atol(argv[++*i]);
+  return true;
+}
+
+static void bench_usage(const char *program) {
+  fprintf(stderr,
+          "Usage %s [--sizes MB,MB,...] [--words] [--threads N] "
+          "[--vocab-size N] [--seed N] [--json] [-o results] [file...]\n",
+          program);
+}
+
+int main(int argc, char **argv) {
+  Bench b = {
+      .seed = 1,
+      .out = stdout,
+  };
+  bpe_options_init(&b.options);
+  b.options.vocab_size = 4096;
+  char *out = NULL;
+  char *sizes = "1,4,16";
+
+  for (int i = 1; i < argc; ++i) {
+    long value = 0;
+    bool ok = true;
+    if (strcmp(argv[i], "--sizes") == 0 && i + 1 < argc) {
+      sizes = argv[++i];
+    } else if (strcmp(argv[i], "--words") == 0) {
+      b.options.words = true;
+    } else if (strcmp(argv[i], "--threads") == 0) {
+      ok = int_option(argc, argv, &i, 1, &value);
+      b.options.threads = value;
+    } else if (strcmp(argv[i], "--vocab-size") == 0) {
+      ok = int_option(argc, argv, &i, 256, &value);
+      b.options.vocab_size = value;
+    } else if (strcmp(argv[i], "--seed") == 0) {
+      ok = int_option(argc, argv, &i, 0, &value);
+      b.seed = value;
+    } else if (strcmp(argv[i], "--json") == 0) {
+      b.json = true;
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      out = argv[++i];
+    } else if (argv[i][0] == '-') {
+      ok = false;
+    } else {
+      da_append(&b.files, argv[i]);
+    }
+
+    if (!ok) {
+      bench_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  // Real files replace the synthetic corpora unless sizes are asked for too
+  bool synthetic = b.files.count == 0;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "--sizes") == 0)
+      synthetic = true;
+  }
+  if (!parse_sizes(sizes, &b.sizes)) {
+    bench_usage(argv[0]);
+    return 1;
+  }
+
+  if (out) {
+    b.out = fopen(out, "w");
+    if (!b.out) {
+      fprintf(stderr, "Cannot open file: <%s>\n", out);
+      return 1;
+    }
+  }
+  if (!b.json)
+    fprintf(b.out, "corpus,phase,bytes,seconds,mb_per_s,merges,merges_per_s,"
+                   "tokens,peak_rss_kb,allocs,alloc_bytes\n");
+
+  bool ok = true;
+  for (size_t i = 0; synthetic && i < b.sizes.count; ++i) {
+    ok = bench_fork(&b, b.sizes.items[i], NULL) && ok;
+  }
+  if (synthetic)
+    ok = bench_fork(&b, 0, NULL) && ok;
+  for (size_t i = 0; i < b.files.count; ++i) {
+    ok = bench_fork(&b, 0, b.files.items[i]) && ok;
+  }
+
+  if (out)
+    fclose(b.out);
+  return ok ? 0 : 1;
+}
@@ -1,141 +1,881 @@
+// The bpe command line tool, a thin driver over the library in bpe.h
+#include "bpe.h"
+
 #define CHAOS_IMPLEMENTATION
 #include <chaos.h>
 
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
 typedef struct {
-  int *items;
+  char **items;
   size_t count;
   size_t capacity;
-} Tokens;
+} Paths;
 
-typedef struct {
-  int left;
-  int right;
-  int token;
-} Merge;
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-typedef struct {
-  Merge *items;
-  size_t count;
-  size_t capacity;
-} Merges;
+static void print_message(void *user, const char *message) {
+  (void)user;
+  printf("%s\n", message);
+}
 
-static void free_table(Table *tb) {
-  if (!tb->items)
-    return;
+static void usage(char *program) {
+  fprintf(stderr,
+          "Usage %s [--reference] [--words] [--threads N] [limits] [-o model] "
+          "<file>\n"
+          "      %s train [--reference] [--words] [--threads N] [limits] "
+          "[-o model] <file>\n"
+          "      %s train --stream [--memory MB] [--threads N] [limits] "
+          "[-o model] <file|dir>...\n"
+          "      %s encode [--raw] [--lines] [--threads N] [--cache N] "
+          "[--cache-policy lru|fifo] [-o tokens] <model> <file>\n"
+          "      %s serve [--raw] [--threads N] [--cache N] [--socket path | "
+          "--port N] [--batch-wait US] [--report S] <model>\n"
+          "      %s info <model>\n"
+          "Limits: --vocab-size N --min-frequency N --max-seconds S\n"
+          "Checkpoints: --checkpoint path --checkpoint-every N "
+          "--checkpoint-seconds S --resume path\n"
+          "Special tokens: --special TOKEN --specials file (one per line)\n"
+          "Tracing: --stats trace.jsonl (built with -DBPE_STATS)\n",
+          program, program, program, program, program, program);
+}
 
-  for (size_t i = 0; i < tb->count; ++i) {
-    chaos_Bucket *b = &tb->items[i];
-    for (size_t j = 0; j < b->count; ++j) {
-      free(b->items[j].value);
-    }
-    free(b->items);
+static int info(char *path) {
+  Bpe_Options options;
+  bpe_options_init(&options);
+  Bpe *b = NULL;
+  bpe_create(&options, &b);
+  Bpe_Info m = {0};
+  if (bpe_load(b, path) != BPE_OK) {
+    bpe_free(b);
+    return 1;
   }
-  free(tb->items);
+  bpe_info(b, &m);
+
+  printf("Model: %s\n", path);
+  printf("Vocab size: %zu\n", m.vocab_size);
+  printf("Merges: %zu\n", m.merges);
+  printf("Special tokens: %zu\n", m.specials);
+  printf("Vocab bytes: %zu\n", m.vocab_bytes);
+
+  bpe_free(b);
+  return 0;
+}
+
+static bool save_model(Bpe *b, char *out) {
+  out = out ? out : "model.bpe";
+  char *text = temp_sprintf("%s.merges.txt", out);
+  if (bpe_save(b, out) != BPE_OK || bpe_save_merges(b, text) != BPE_OK)
+    return false;
+  printf("Saved %s and %s\n", out, text);
+  return true;
+}
 
-  tb->items = NULL;
-  tb->count = 0;
-  tb->capacity = 0;
+static void report(Bpe_Train_Result *r) {
+  printf("Final token count: %zu\n", r->tokens);
+  printf("Vocab size: %zu\n", r->vocab_size);
+  printf("Merges: %zu\n", r->merges);
+  if (r->stop != BPE_STOP_DONE)
+    printf("Stopped early: %s\n", bpe_stop_name(r->stop));
 }
 
-static void decode_token(int token, Merges *merges, String_Builder *out) {
-  if (token < 256) {
-    da_append(out, (char)token);
-    return;
+static int run_train(Bpe *b, char *out, char *file, bool save) {
+  String_View text = {0};
+  if (!map_file(file, &text))
+    return 1;
+
+  Bpe_Train_Result r = {0};
+  Bpe_Status status = bpe_train(b, text.data, text.count, &r);
+  unmap_file(&text);
+  if (status != BPE_OK)
+    return 1;
+  report(&r);
+
+  // Hitting a limit keeps the merges even when only running
+  if (save || r.stop != BPE_STOP_DONE) {
+    if (!save_model(b, out))
+      return 1;
+    if (save)
+      return 0;
   }
 
-  for (size_t i = merges->count; i-- > 0;) {
-    if (merges->items[i].token == token) {
-      decode_token(merges->items[i].left, merges, out);
-      decode_token(merges->items[i].right, merges, out);
-      return;
+  size_t count = 0;
+  uint32_t *tokens = malloc((r.tokens ? r.tokens : 1) * sizeof(*tokens));
+  CHAOS_ASSERT(tokens != NULL && "Buy more RAM lol");
+  bpe_training_tokens(b, tokens, r.tokens, &count);
+  size_t size = 0;
+  bpe_decode(b, tokens, count, NULL, 0, &size);
+  char *decoded = malloc(size + 1);
+  CHAOS_ASSERT(decoded != NULL && "Buy more RAM lol");
+  bpe_decode(b, tokens, count, decoded, size, &size);
+  decoded[size] = '\0';
+
+  printf("%s\n", decoded);
+  free(decoded);
+  free(tokens);
+  return 0;
+}
+
+static int run_stream(Bpe *b, char *out, Paths *inputs) {
+  Bpe_Train_Result r = {0};
+  if (bpe_train_files(b, (const char *const *)inputs->items, inputs->count,
+                      &r) != BPE_OK)
+    return 1;
+  report(&r);
+  return save_model(b, out) ? 0 : 1;
+}
+
+// Encodes file with the model, reports the throughput and checks that
+// decoding the tokens gives the file back.
+static int run_encode(Bpe *b, bool lines, char *out, char *model_path,
+                      char *file) {
+  if (bpe_load(b, model_path) != BPE_OK)
+    return 1;
+
+  String_View text = {0};
+  if (!map_file(file, &text))
+    return 1;
+
+  // Never more tokens than bytes
+  uint32_t *tokens = malloc((text.count ? text.count : 1) * sizeof(*tokens));
+  char *decoded = malloc(text.count ? text.count : 1);
+  CHAOS_ASSERT(tokens && decoded && "Buy more RAM lol");
+  size_t count = 0;
+
+  // With --lines every line is a document of its own, encoded as a batch
+  double start = now();
+  if (lines) {
+    Bpe_View *docs = NULL;
+    size_t doc_count = 0;
+    for (size_t i = 0; i < text.count; ++doc_count) {
+      const char *nl = memchr(text.data + i, '\n', text.count - i);
+      i = nl ? (size_t)(nl - text.data) + 1 : text.count;
+    }
+    docs = malloc((doc_count ? doc_count : 1) * sizeof(*docs));
+    size_t *offsets = malloc((doc_count + 1) * sizeof(*offsets));
+    CHAOS_ASSERT(docs && offsets && "Buy more RAM lol");
+    for (size_t i = 0, d = 0; i < text.count; ++d) {
+      const char *nl = memchr(text.data + i, '\n', text.count - i);
+      size_t end = nl ? (size_t)(nl - text.data) + 1 : text.count;
+      docs[d] = (Bpe_View){text.data + i, end - i};
+      i = end;
     }
+
+    start = now();
+    bpe_encode_batch(b, docs, doc_count, tokens, text.count, offsets, &count);
+    printf("Documents: %zu\n", doc_count);
+    free(offsets);
+    free(docs);
+  } else {
+    bpe_encode(b, text.data, text.count, tokens, text.count, &count);
+  }
+  double elapsed = now() - start;
+
+  size_t size = 0;
+  double decode_start = now();
+  Bpe_Status decoded_ok =
+      bpe_decode(b, tokens, count, decoded, text.count, &size);
+  double decode_elapsed = now() - decode_start;
+  bool round_trip = decoded_ok == BPE_OK && size == text.count &&
+                    memcmp(decoded, text.data, text.count) == 0;
+
+  Bpe_Cache_Stats cache = {0};
+  bpe_cache_stats(b, &cache);
+  printf("Tokens: %zu\n", count);
+  printf("Encoded %zu bytes in %.3f ms (%.2f MB/s)\n", text.count, elapsed * 1e3,
+         elapsed > 0 ? text.count / elapsed / 1e6 : 0.0);
+  printf("Decoded in %.3f ms (%.2f MB/s)\n", decode_elapsed * 1e3,
+         decode_elapsed > 0 ? size / decode_elapsed / 1e6 : 0.0);
+  if (cache.hits + cache.misses > 0)
+    printf("Cache: %zu hits, %zu misses (%.1f%% hit rate), %zu evictions\n",
+           cache.hits, cache.misses,
+           100.0 * cache.hits / (cache.hits + cache.misses), cache.evictions);
+  printf("Round trip: %s\n", round_trip ? "ok" : "FAILED");
+
+  bool ok = round_trip;
+  if (out) {
+    String_Builder ids = {
+        .items = (char *)tokens,
+        .count = count * sizeof(*tokens),
+    };
+    ok = write_file(out, &ids) && ok;
   }
+
+  free(decoded);
+  free(tokens);
+  unmap_file(&text);
+  return ok ? 0 : 1;
 }
 
-int main(int argc, char **argv) {
+// The `bpe serve` protocol. Every integer is a little endian uint32.
+//   request   op, size, payload[size]
+//   response  status, size, payload[size]
+// SERVE_ENCODE sends text and gets token ids back. SERVE_DECODE does the
+// reverse, and an id outside the vocab fails with BPE_ERROR_ARGUMENT and the
+// index of that id as the payload. SERVE_STATS gets the counters as one line
+// of text. status is a Bpe_Status.
+enum { SERVE_ENCODE, SERVE_DECODE, SERVE_STATS };
 
-  if (argc != 2) {
-    fprintf(stderr, "Usage %s <file>\n", argv[0]);
-    return 1;
+// Requests bigger than this close the connection
+#define SERVE_MAX_REQUEST (64u << 20)
+// At most this many requests go into one batch
+#define SERVE_BATCH 256
+
+// One request in flight. It belongs to its connection thread, which waits on
+// ready until the batcher sets done. out starts with room for the response
+// header.
+typedef struct Request {
+  uint32_t op;
+  String_Builder in;
+  String_Builder out;
+  uint32_t status;
+  double arrived;
+  bool done;
+  pthread_cond_t ready;
+  struct Request *next;
+} Request;
+
+// Latencies in microseconds. The first 16 buckets are one microsecond
+// wide, then every power of two is split into 8, so a percentile read back
+// is within 1/16 of the real one and the histogram never grows.
+#define LATENCY_SPLIT 8
+#define LATENCY_BUCKETS (38 * LATENCY_SPLIT)
+
+typedef struct {
+  size_t counts[LATENCY_BUCKETS];
+  size_t count;
+} Latencies;
+
+// Everything under lock. clients counts the open connections. The counters
+// cover the window that started at since, and they are reported and reset
+// every report seconds.
+typedef struct {
+  Bpe *bpe;
+  double wait;
+  double report;
+  pthread_mutex_t lock;
+  pthread_cond_t pending;
+  Request *head;
+  Request *tail;
+  size_t queued;
+  size_t clients;
+  bool stop;
+  double since;
+  size_t requests;
+  size_t batches;
+  size_t bytes;
+  size_t tokens;
+  Latencies latencies;
+} Server;
+
+typedef struct {
+  Server *server;
+  int fd;
+} Connection;
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_signal(int sig) {
+  (void)sig;
+  serve_stop = 1;
+}
+
+static bool read_all(int fd, void *data, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t n = read(fd, (char *)data + done, size - done);
+    if (n <= 0 && !(n < 0 && errno == EINTR))
+      return false;
+    if (n > 0)
+      done += n;
   }
+  return true;
+}
 
-  String_Builder sb = {0};
-  read_file(argv[1], &sb);
+static bool write_all(int fd, const void *data, size_t size) {
+  for (size_t done = 0; done < size;) {
+    ssize_t n = send(fd, (const char *)data + done, size - done, MSG_NOSIGNAL);
+    if (n < 0 && errno != EINTR)
+      return false;
+    if (n > 0)
+      done += n;
+  }
+  return true;
+}
+
+static void latencies_add(Latencies *l, double seconds) {
+  uint64_t us = seconds > 0 ? (uint64_t)(seconds * 1e6) : 0;
+  size_t shift = 0;
+  while ((us >> shift) >= 2 * LATENCY_SPLIT)
+    shift++;
+  size_t bucket = shift * LATENCY_SPLIT + (us >> shift);
+  l->counts[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1]++;
+  l->count++;
+}
+
+// The middle of the bucket holding the latency at percent, in seconds
+static double latencies_percentile(const Latencies *l, size_t percent) {
+  if (l->count == 0)
+    return 0;
+  size_t rank = (l->count - 1) * percent / 100, seen = 0, bucket = 0;
+  while (seen + l->counts[bucket] <= rank)
+    seen += l->counts[bucket++];
+  if (bucket < 2 * LATENCY_SPLIT)
+    return bucket / 1e6;
+  size_t shift = bucket / LATENCY_SPLIT - 1;
+  uint64_t low = (uint64_t)(bucket % LATENCY_SPLIT + LATENCY_SPLIT) << shift;
+  return (low + ((uint64_t)1 << shift) / 2) / 1e6;
+}
+
+// The counters of the current window as one line, lock held
+static void serve_line(Server *s, String_Builder *out) {
+  double elapsed = now() - s->since;
+  double p50 = latencies_percentile(&s->latencies, 50);
+  double p99 = latencies_percentile(&s->latencies, 99);
+  sb_appendf(out,
+             "Served %zu requests in %zu batches (%.1f per batch) over %.1f s: "
+             "%.0f req/s, %.2f MB/s, %.0f tokens/s, p50 %.3f ms, p99 %.3f ms",
+             s->requests, s->batches,
+             s->batches ? (double)s->requests / s->batches : 0.0, elapsed,
+             elapsed > 0 ? s->requests / elapsed : 0.0,
+             elapsed > 0 ? s->bytes / elapsed / 1e6 : 0.0,
+             elapsed > 0 ? s->tokens / elapsed : 0.0, p50 * 1e3, p99 * 1e3);
+}
+
+static void serve_report(Server *s) {
+  if (s->requests > 0) {
+    String_Builder line = {0};
+    serve_line(s, &line);
+    printf("%.*s\n", (int)line.count, line.items);
+    fflush(stdout);
+    free(line.items);
+  }
+  s->since = now();
+  s->requests = s->batches = s->bytes = s->tokens = 0;
+  memset(&s->latencies, 0, sizeof(s->latencies));
+}
+
+static void response_begin(Request *r) {
+  r->out.count = 0;
+  da_reserve(&r->out, 2 * sizeof(uint32_t));
+  r->out.count = 2 * sizeof(uint32_t);
+}
+
+// Runs one batch. The encode requests all go through a single
+// bpe_encode_batch. The others run one after the other.
+static void serve_batch(Server *s, Request **batch, size_t count,
+                        Bpe_View *views, size_t *offsets, Request **encodes,
+                        uint32_t **tokens, size_t *capacity) {
+  size_t n = 0, bytes = 0;
+  for (size_t i = 0; i < count; ++i) {
+    Request *r = batch[i];
+    response_begin(r);
+    if (r->op == SERVE_ENCODE) {
+      views[n] = (Bpe_View){r->in.items, r->in.count};
+      encodes[n++] = r;
+      bytes += r->in.count;
+    } else if (r->op == SERVE_DECODE && r->in.count % sizeof(uint32_t) == 0) {
+      const uint32_t *ids = (const uint32_t *)r->in.items;
+      size_t ids_count = r->in.count / sizeof(uint32_t), size = 0;
+      r->status = bpe_decode(s->bpe, ids, ids_count, NULL, 0, &size);
+      if (r->status == BPE_ERROR_BUFFER) {
+        da_reserve(&r->out, r->out.count + size);
+        r->status = bpe_decode(s->bpe, ids, ids_count,
+                               r->out.items + r->out.count, size, &size);
+      }
+      if (r->status == BPE_OK) {
+        r->out.count += size;
+      } else if (r->status == BPE_ERROR_ARGUMENT) {
+        // An id outside the vocab answers with its index
+        uint32_t index = size;
+        da_reserve(&r->out, r->out.count + sizeof(index));
+        memcpy(r->out.items + r->out.count, &index, sizeof(index));
+        r->out.count += sizeof(index);
+      }
+    } else if (r->op == SERVE_STATS) {
+      pthread_mutex_lock(&s->lock);
+      serve_line(s, &r->out);
+      pthread_mutex_unlock(&s->lock);
+      r->status = BPE_OK;
+    } else {
+      r->status = BPE_ERROR_ARGUMENT;
+    }
+  }
+
+  // Never more tokens than bytes
+  if (bytes > *capacity) {
+    *capacity = bytes;
+    *tokens = realloc(*tokens, *capacity * sizeof(**tokens));
+    CHAOS_ASSERT(*tokens != NULL && "Buy more RAM lol");
+  }
+  size_t total = 0;
+  Bpe_Status status = BPE_OK;
+  if (n > 0)
+    status = bpe_encode_batch(s->bpe, views, n, *tokens, *capacity, offsets,
+                              &total);
+  for (size_t i = 0; i < n; ++i) {
+    Request *r = encodes[i];
+    size_t size = (offsets[i + 1] - offsets[i]) * sizeof(**tokens);
+    r->status = status;
+    if (status != BPE_OK)
+      continue;
+    da_reserve(&r->out, r->out.count + size);
+    memcpy(r->out.items + r->out.count, *tokens + offsets[i], size);
+    r->out.count += size;
+  }
 
-  Tokens tokens = {0};
-  for (size_t i = 0; i < sb.count; ++i) {
-    da_append(&tokens, (unsigned char)sb.items[i]);
+  pthread_mutex_lock(&s->lock);
+  double done = now();
+  s->batches++;
+  s->bytes += bytes;
+  s->tokens += total;
+  for (size_t i = 0; i < count; ++i) {
+    Request *r = batch[i];
+    uint32_t header[2] = {r->status, r->out.count - sizeof(header)};
+    memcpy(r->out.items, header, sizeof(header));
+    s->requests++;
+    latencies_add(&s->latencies, done - r->arrived);
+    r->done = true;
+    pthread_cond_signal(&r->ready);
   }
+  pthread_mutex_unlock(&s->lock);
+}
 
-  Merges merges = {0};
-  int next_token = 256;
+// Waits for requests, gives others up to wait seconds to join them, and runs
+// them as one batch. Also reports the counters every report seconds.
+static void *serve_batcher(void *arg) {
+  Server *s = arg;
+  Request *batch[SERVE_BATCH];
+  Request *encodes[SERVE_BATCH];
+  Bpe_View views[SERVE_BATCH];
+  size_t offsets[SERVE_BATCH + 1];
+  uint32_t *tokens = NULL;
+  size_t capacity = 0;
 
+  pthread_mutex_lock(&s->lock);
   for (;;) {
-    Table tb = {0};
+    if (s->report > 0 && now() - s->since >= s->report)
+      serve_report(s);
+    if (!s->head && !s->stop) {
+      struct timespec until = {0};
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += 1;
+      pthread_cond_timedwait(&s->pending, &s->lock, &until);
+      continue;
+    }
+    if (!s->head)
+      break;
 
-    for (size_t i = 0; i + 1 < tokens.count; ++i) {
-      char *key = strdup(
-          temp_sprintf("%03d%03d", tokens.items[i], tokens.items[i + 1]));
-      table_append(&tb, key, 6);
+    // Only connections can add to a batch, so a lone client never waits
+    size_t most = s->clients < SERVE_BATCH ? s->clients : SERVE_BATCH;
+    double deadline = s->head->arrived + s->wait;
+    while (s->queued < most && !s->stop && now() < deadline) {
+      double left = deadline - now();
+      struct timespec until = {0};
+      clock_gettime(CLOCK_REALTIME, &until);
+      long ns = until.tv_nsec + (long)(left * 1e9);
+      until.tv_sec += ns / 1000000000L;
+      until.tv_nsec = ns % 1000000000L;
+      pthread_cond_timedwait(&s->pending, &s->lock, &until);
     }
 
-    chaos_KV *best = NULL;
-    for (size_t i = 0; i < tb.count; ++i) {
-      chaos_Bucket *b = &tb.items[i];
-      for (size_t j = 0; j < b->count; ++j) {
-        if (!best || b->items[j].freq > best->freq) {
-          best = &b->items[j];
-        }
-      }
+    size_t count = 0;
+    while (s->head && count < SERVE_BATCH) {
+      batch[count++] = s->head;
+      s->head = s->head->next;
+      s->queued--;
     }
+    if (!s->head)
+      s->tail = NULL;
+    pthread_mutex_unlock(&s->lock);
+    serve_batch(s, batch, count, views, offsets, encodes, &tokens, &capacity);
+    pthread_mutex_lock(&s->lock);
+  }
+  pthread_mutex_unlock(&s->lock);
+  free(tokens);
+  return NULL;
+}
 
-    if (!best || best->freq <= 1) {
-      free_table(&tb);
+// Reads requests off one connection and hands them to the batcher, one at a
+// time. Clients wanting more in flight open more connections.
+static void *serve_connection(void *arg) {
+  Connection *c = arg;
+  Server *s = c->server;
+  Request r = {0};
+  pthread_cond_init(&r.ready, NULL);
+  pthread_mutex_lock(&s->lock);
+  s->clients++;
+  pthread_mutex_unlock(&s->lock);
+
+  for (;;) {
+    uint32_t header[2];
+    if (!read_all(c->fd, header, sizeof(header)) ||
+        header[1] > SERVE_MAX_REQUEST)
       break;
+    r.in.count = 0;
+    da_reserve(&r.in, header[1]);
+    if (!read_all(c->fd, r.in.items, header[1]))
+      break;
+    r.in.count = header[1];
+    r.op = header[0];
+    r.done = false;
+    r.next = NULL;
+
+    pthread_mutex_lock(&s->lock);
+    r.arrived = now();
+    if (s->tail)
+      s->tail->next = &r;
+    else
+      s->head = &r;
+    s->tail = &r;
+    s->queued++;
+    pthread_cond_signal(&s->pending);
+    while (!r.done) {
+      pthread_cond_wait(&r.ready, &s->lock);
     }
+    pthread_mutex_unlock(&s->lock);
 
-    char a_buf[4] = {0};
-    char b_buf[4] = {0};
-    memcpy(a_buf, best->value, 3);
-    memcpy(b_buf, best->value + 3, 3);
-
-    int A = atoi(a_buf);
-    int B = atoi(b_buf);
-
-    Tokens next = {0};
-    for (size_t i = 0; i < tokens.count;) {
-      if (i + 1 < tokens.count && tokens.items[i] == A &&
-          tokens.items[i + 1] == B) {
-        da_append(&next, next_token);
-        i += 2;
-      } else {
-        da_append(&next, tokens.items[i]);
-        i += 1;
-      }
+    if (!write_all(c->fd, r.out.items, r.out.count))
+      break;
+  }
+
+  pthread_mutex_lock(&s->lock);
+  s->clients--;
+  pthread_mutex_unlock(&s->lock);
+  close(c->fd);
+  pthread_cond_destroy(&r.ready);
+  free(r.in.items);
+  free(r.out.items);
+  free(c);
+  return NULL;
+}
+
+// A Unix socket at path, or localhost TCP on port when path is NULL
+static int serve_listen(char *path, long port) {
+  int fd = -1;
+  if (path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+      fprintf(stderr, "Socket path too long: <%s>\n", path);
+      return -1;
+    }
+    strcpy(addr.sun_path, path);
+    // Only a socket left behind by an earlier server is replaced
+    struct stat st;
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+      unlink(path);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  } else {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons((uint16_t)port),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int one = 1;
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0 &&
+        (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+         bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)) {
+      close(fd);
+      fd = -1;
+    }
+  }
+
+  if (fd < 0 || listen(fd, SOMAXCONN) < 0) {
+    fprintf(stderr, "Cannot listen on %s: %s\n",
+            path ? path : temp_sprintf("127.0.0.1:%ld", port), strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Keeps the model loaded and encodes what clients send, batching requests
+// that arrive close together, until SIGINT or SIGTERM.
+static int run_serve(Bpe *b, char *model_path, char *path, long port,
+                     double wait, double report) {
+  if (bpe_load(b, model_path) != BPE_OK)
+    return 1;
+  int fd = serve_listen(path, port);
+  if (fd < 0)
+    return 1;
+
+  struct sigaction sa = {.sa_handler = serve_signal};
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  // Static, connection threads may still hold on to it until exit
+  static Server s;
+  s = (Server){.bpe = b, .wait = wait, .report = report, .since = now()};
+  pthread_mutex_init(&s.lock, NULL);
+  pthread_cond_init(&s.pending, NULL);
+  pthread_t batcher;
+  pthread_create(&batcher, NULL, serve_batcher, &s);
+  if (path)
+    printf("Serving %s on %s\n", model_path, path);
+  else
+    printf("Serving %s on 127.0.0.1:%ld\n", model_path, port);
+  fflush(stdout);
+
+  while (!serve_stop) {
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    if (poll(&pfd, 1, 250) <= 0)
+      continue;
+    int client = accept(fd, NULL, NULL);
+    if (client < 0)
+      continue;
+    if (!path) {
+      int one = 1;
+      setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    Connection *c = malloc(sizeof(*c));
+    CHAOS_ASSERT(c != NULL && "Buy more RAM lol");
+    *c = (Connection){.server = &s, .fd = client};
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, serve_connection, c) != 0) {
+      close(client);
+      free(c);
+      continue;
     }
+    pthread_detach(thread);
+  }
+
+  // Requests already queued are answered, then whatever is left of the
+  // window is reported
+  close(fd);
+  if (path)
+    unlink(path);
+  pthread_mutex_lock(&s.lock);
+  s.stop = true;
+  pthread_cond_signal(&s.pending);
+  pthread_mutex_unlock(&s.lock);
+  pthread_join(batcher, NULL);
+  serve_report(&s);
+  return 0;
+}
+
+// Adds the lines of a file as special tokens, skipping empty ones. The file
+// stays in a buffer of its own that the tokens point into.
+static bool read_specials(char *path, Paths *specials, Paths *buffers) {
+  String_Builder sb = {0};
+  if (!read_file(path, &sb)) {
+    free(sb.items);
+    return false;
+  }
+  sb_append_null(&sb);
+  da_append(buffers, sb.items);
+  for (char *line = sb.items; *line;) {
+    char *end = strchr(line, '\n');
+    char *next = end ? end + 1 : line + strlen(line);
+    if (!end)
+      end = next;
+    if (end > line && end[-1] == '\r')
+      end--;
+    *end = '\0';
+    if (*line)
+      da_append(specials, line);
+    line = next;
+  }
+  return true;
+}
+
+// The value after option i, a whole number of at least min
+static bool int_option(int argc, char **argv, int *i, long min, long *out) {
+  if (*i + 1 >= argc || !is_int(argv[*i + 1]) || atol(argv[*i + 1]) < min)
+    return false;
+  *out = atol(argv[++*i]);
+  return true;
+}
+
+int main(int argc, char **argv) {
+  if (argc == 3 && strcmp(argv[1], "info") == 0)
+    return info(argv[2]);
+
+  char *command = "run";
+  int first = 1;
+  if (argc > 1 && (strcmp(argv[1], "train") == 0 ||
+                   strcmp(argv[1], "encode") == 0 ||
+                   strcmp(argv[1], "serve") == 0)) {
+    command = argv[1];
+    first = 2;
+  }
 
-    da_append(&merges, ((Merge){
-                           .left = A,
-                           .right = B,
-                           .token = next_token,
-                       }));
+  Bpe_Options options;
+  bpe_options_init(&options);
+  options.log = print_message;
+  bool lines = false;
+  bool raw = false;
+  bool stream = false;
+  char *out = NULL;
+  char *socket_path = NULL;
+  long port = 0;
+  long batch_wait = 200;
+  double report = 10;
+  Paths args = {0};
+  Paths specials = {0};
+  Paths buffers = {0};
 
-    free(tokens.items);
-    tokens = next;
-    next_token++;
+  for (int i = first; i < argc; ++i) {
+    long value = 0;
+    bool ok = true;
+    if (strcmp(argv[i], "--reference") == 0) {
+      options.reference = true;
+    } else if (strcmp(argv[i], "--words") == 0) {
+      options.words = true;
+    } else if (strcmp(argv[i], "--raw") == 0) {
+      raw = true;
+    } else if (strcmp(argv[i], "--lines") == 0) {
+      lines = true;
+    } else if (strcmp(argv[i], "--cache") == 0) {
+      ok = int_option(argc, argv, &i, 0, &value);
+      options.cache_size = value;
+    } else if (strcmp(argv[i], "--cache-policy") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "lru") == 0)
+        options.cache_policy = BPE_CACHE_LRU;
+      else if (strcmp(argv[i], "fifo") == 0)
+        options.cache_policy = BPE_CACHE_FIFO;
+      else
+        ok = false;
+    } else if (strcmp(argv[i], "--threads") == 0) {
+      ok = int_option(argc, argv, &i, 1, &value);
+      options.threads = value;
+    } else if (first == 2 && strcmp(argv[i], "--stream") == 0) {
+      stream = true;
+    } else if (first == 2 && strcmp(argv[i], "--memory") == 0) {
+      ok = int_option(argc, argv, &i, 1, &value);
+      options.memory = (size_t)value << 20;
+    } else if (strcmp(argv[i], "--vocab-size") == 0) {
+      ok = int_option(argc, argv, &i, 256, &value) && value <= INT32_MAX;
+      options.vocab_size = value;
+    } else if (strcmp(argv[i], "--min-frequency") == 0) {
+      ok = int_option(argc, argv, &i, 2, &value);
+      options.min_frequency = value;
+    } else if (strcmp(argv[i], "--max-seconds") == 0) {
+      ok = i + 1 < argc && (is_int(argv[i + 1]) || is_float(argv[i + 1])) &&
+           atof(argv[i + 1]) > 0;
+      if (ok)
+        options.max_seconds = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc) {
+      options.checkpoint = argv[++i];
+    } else if (strcmp(argv[i], "--checkpoint-every") == 0) {
+      ok = int_option(argc, argv, &i, 1, &value);
+      options.checkpoint_every = value;
+    } else if (strcmp(argv[i], "--checkpoint-seconds") == 0) {
+      ok = i + 1 < argc && (is_int(argv[i + 1]) || is_float(argv[i + 1])) &&
+           atof(argv[i + 1]) > 0;
+      if (ok)
+        options.checkpoint_seconds = atof(argv[++i]);
+    } else if (strcmp(argv[i], "--resume") == 0 && i + 1 < argc) {
+      options.resume = argv[++i];
+    } else if (strcmp(argv[i], "--special") == 0 && i + 1 < argc) {
+      da_append(&specials, argv[++i]);
+    } else if (strcmp(argv[i], "--specials") == 0 && i + 1 < argc) {
+      if (!read_specials(argv[++i], &specials, &buffers))
+        return 1;
+    } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+      options.stats_path = argv[++i];
+    } else if (strcmp(argv[i], "--socket") == 0 && i + 1 < argc) {
+      socket_path = argv[++i];
+    } else if (strcmp(argv[i], "--port") == 0) {
+      ok = int_option(argc, argv, &i, 1, &port) && port <= 65535;
+    } else if (strcmp(argv[i], "--batch-wait") == 0) {
+      ok = int_option(argc, argv, &i, 0, &batch_wait);
+    } else if (strcmp(argv[i], "--report") == 0) {
+      ok = i + 1 < argc && (is_int(argv[i + 1]) || is_float(argv[i + 1])) &&
+           atof(argv[i + 1]) >= 0;
+      if (ok)
+        report = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      out = argv[++i];
+    } else {
+      da_append(&args, argv[i]);
+    }
 
-    free_table(&tb);
+    if (!ok) {
+      usage(argv[0]);
+      return 1;
+    }
   }
 
-  printf("Final token count: %zu\n", tokens.count);
-  printf("Vocab size: %d\n", next_token);
-  printf("Merges: %zu\n", merges.count);
+  // An interval alone checkpoints next to the model. Saves go through
+  // temp_sprintf, so the path needs a buffer of its own.
+  if (!options.checkpoint &&
+      (options.checkpoint_every || options.checkpoint_seconds > 0)) {
+    char *model = out ? out : "model.bpe";
+    size_t n = strlen(model) + sizeof(".ckpt");
+    char *path = malloc(n);
+    CHAOS_ASSERT(path != NULL && "Buy more RAM lol");
+    snprintf(path, n, "%s.ckpt", model);
+    options.checkpoint = path;
+  }
 
-  String_Builder decoded = {0};
-  for (size_t i = 0; i < tokens.count; ++i) {
-    decode_token(tokens.items[i], &merges, &decoded);
+  bool encoding = strcmp(command, "encode") == 0;
+  bool training = strcmp(command, "train") == 0;
+  bool serving = strcmp(command, "serve") == 0;
+  if ((raw && (options.words || (!encoding && !serving))) ||
+      (encoding && args.count != 2) ||
+      (stream && (!training || options.reference || args.count == 0)) ||
+      (!encoding && !stream && args.count != 1) ||
+      (serving && socket_path && port)) {
+    usage(argv[0]);
+    return 1;
   }
-  sb_append_null(&decoded);
 
-  printf("%s\n", decoded.items);
+  // Encoding splits into words unless told otherwise, the raw path is slow
+  if ((encoding || serving) && !raw)
+    options.words = true;
+
+  // Only run mode prints the trained corpus back
+  options.keep_tokens = !encoding && !stream && !training && !serving;
+  options.specials = (const char *const *)specials.items;
+  options.special_count = specials.count;
+  Bpe *b = NULL;
+  Bpe_Status status = bpe_create(&options, &b);
+  if (status == BPE_ERROR_UNSUPPORTED)
+    fprintf(stderr, "--stats needs a build with -DBPE_STATS\n");
+  bool room = options.vocab_size == 0 ||
+              (size_t)options.vocab_size >= 256 + specials.count;
+  if (status == BPE_ERROR_ARGUMENT && !room)
+    fprintf(stderr, "--vocab-size must be at least 256 plus the %zu special "
+                    "tokens\n", specials.count);
+  else if (status == BPE_ERROR_ARGUMENT && specials.count > 0)
+    fprintf(stderr, "Special tokens must be distinct and not empty\n");
+
+  int result = 1;
+  if (status == BPE_OK) {
+    if (encoding)
+      result = run_encode(b, lines, out, args.items[0], args.items[1]);
+    else if (serving)
+      result = run_serve(b, args.items[0],
+                         port ? NULL : socket_path ? socket_path : "bpe.sock",
+                         port, batch_wait * 1e-6, report);
+    else if (stream)
+      result = run_stream(b, out, &args);
+    else
+      result = run_train(b, out, args.items[0], training);
+  }
+  bpe_free(b);
+  for (size_t k = 0; k < buffers.count; ++k) {
+    free(buffers.items[k]);
+  }
+  free(buffers.items);
+  free(specials.items);
+  free(args.items);
+  return result;
 }
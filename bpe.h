@@ -0,0 +1,139 @@
+/*
+  bpe.h - the trainer, encoder and decoder of bpe.c as a library
+
+  Build it once, as either a static or a shared library, and link it with -lpthread:
+    gcc -O2 -I. -c libbpe.c && ar rcs libbpe.a libbpe.o
+    gcc -O2 -I. -shared -fPIC -o libbpe.so libbpe.c -lpthread
+
+  Good to knows:
+  - A Bpe handle holds one model. That model is either trained or loaded. The handle also holds the buffers that
+    encoding reuses, so once they have grown to fit, encoding allocates nothing. Calls on one handle must not overlap,
+    so use a handle per thread. bpe_encode_batch spreads a batch over options.threads on its own.
+  - Every output goes into a buffer the caller provides. When a buffer is too small, the call returns
+    BPE_ERROR_BUFFER and still stores the size it needed. Encoding never makes more tokens than the text has bytes, so
+    a buffer of one token per byte always fits.
+  - Strings in Bpe_Options are not copied. They must stay valid while the handle lives.
+  - Errors with files are described on stderr, like the bpe CLI does.
+  - Special tokens belong to the model. Their ids follow the merged tokens in the order they were given. Encoding
+    finds them before anything else and gives each one its id, never merging it or splitting it into bytes. A model
+    that is loaded brings its own special tokens, and options.specials only matters for training.
+*/
+
+#ifndef BPE_H_
+#define BPE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Bpe Bpe;
+
+typedef enum {
+  BPE_OK,
+  BPE_ERROR_IO,          // a file could not be read or written, or is not a valid model or checkpoint
+  BPE_ERROR_ARGUMENT,    // the options or arguments make no sense together
+  BPE_ERROR_BUFFER,      // an output buffer is too small, the size it needs was stored anyway
+  BPE_ERROR_STATE,       // there is no model yet
+  BPE_ERROR_UNSUPPORTED, // stats_path without a build with -DBPE_STATS
+} Bpe_Status;
+
+// Why training stopped. BPE_STOP_DONE means no pair occurs twice any more. The others are the limits in Bpe_Options.
+typedef enum {
+  BPE_STOP_NONE,
+  BPE_STOP_DONE,
+  BPE_STOP_VOCAB_SIZE,
+  BPE_STOP_MIN_FREQUENCY,
+  BPE_STOP_MAX_SECONDS,
+  BPE_STOP_FAILED,
+} Bpe_Stop;
+
+typedef enum {
+  BPE_CACHE_LRU,
+  BPE_CACHE_FIFO,
+} Bpe_Cache_Policy;
+
+// Receives the progress messages of training: checkpoints, resumes and what streaming read. There is no trailing newline.
+typedef void (*Bpe_Log)(void *user, const char *message);
+
+typedef struct {
+  bool words;                    // split into words like GPT-2, for both training and encoding
+  bool reference;                // recount every pair on every merge, slow, for checking
+  size_t threads;                // for counting pairs and encoding batches, at least 1
+  size_t memory;                 // bpe_train_files spills word counts to disk beyond this many bytes, 0 never does.
+                                 // It only bounds collecting them, training still loads every distinct word.
+  int vocab_size;                // training limits, 0 for none. vocab_size counts the bytes and special tokens,
+                                 // so it is at least 256 plus their number
+  size_t min_frequency;          // at least 2
+  double max_seconds;            // counted from the start of each bpe_train
+  const char *checkpoint;        // snapshot training here...
+  size_t checkpoint_every;       // ...every this many merges
+  double checkpoint_seconds;     // ...and/or this often
+  const char *resume;            // continue from this checkpoint
+  const char *stats_path;        // JSONL trace of every iteration, builds with -DBPE_STATS only
+  bool keep_tokens;              // keep the trained corpus for bpe_training_tokens
+  const char *const *specials;   // special tokens, kept out of training and stored in the model it makes
+  size_t special_count;
+  size_t cache_size;             // words whose tokens each encoding thread remembers, 0 for none
+  Bpe_Cache_Policy cache_policy;
+  Bpe_Log log;
+  void *log_user;
+} Bpe_Options;
+
+typedef struct {
+  size_t tokens;                 // tokens of the training corpus once merged
+  size_t vocab_size;             // bytes, merges and special tokens
+  size_t merges;
+  Bpe_Stop stop;
+} Bpe_Train_Result;
+
+typedef struct {
+  size_t vocab_size;             // bytes, merges and special tokens
+  size_t merges;
+  size_t specials;
+  size_t vocab_bytes;            // the bytes of all tokens together
+} Bpe_Info;
+
+typedef struct {
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+} Bpe_Cache_Stats;
+
+typedef struct {
+  const char *data;
+  size_t count;
+} Bpe_View;
+
+// Fills options with the defaults of the bpe CLI
+void bpe_options_init(Bpe_Options *options);
+Bpe_Status bpe_create(const Bpe_Options *options, Bpe **bpe);
+void bpe_free(Bpe *bpe);
+
+// Train a new model that replaces the current one. bpe_train takes the text itself. bpe_train_files streams files and
+// directories like `bpe train --stream` does. That always splits into words and cannot use the reference trainer.
+Bpe_Status bpe_train(Bpe *bpe, const char *text, size_t size, Bpe_Train_Result *result);
+Bpe_Status bpe_train_files(Bpe *bpe, const char *const *paths, size_t count, Bpe_Train_Result *result);
+// Copies the trained corpus as tokens, which needs options.keep_tokens
+Bpe_Status bpe_training_tokens(const Bpe *bpe, uint32_t *tokens, size_t capacity, size_t *count);
+
+// bpe_save writes the binary model file. bpe_save_merges writes the usual merges.txt export. bpe_load mmaps a model
+// file, which replaces the current model.
+Bpe_Status bpe_save(const Bpe *bpe, const char *path);
+Bpe_Status bpe_save_merges(const Bpe *bpe, const char *path);
+Bpe_Status bpe_load(Bpe *bpe, const char *path);
+Bpe_Status bpe_info(const Bpe *bpe, Bpe_Info *info);
+
+Bpe_Status bpe_encode(Bpe *bpe, const char *text, size_t size, uint32_t *tokens, size_t capacity, size_t *count);
+// Encodes count documents over options.threads. The tokens of document d are tokens[offsets[d]..offsets[d + 1]].
+// offsets has count + 1 entries, and total receives offsets[count].
+Bpe_Status bpe_encode_batch(Bpe *bpe, const Bpe_View *docs, size_t count, uint32_t *tokens, size_t capacity,
+                            size_t *offsets, size_t *total);
+// An id outside the vocab fails with BPE_ERROR_ARGUMENT, and size receives the index of the first one
+Bpe_Status bpe_decode(const Bpe *bpe, const uint32_t *tokens, size_t count, char *out, size_t capacity, size_t *size);
+// Sums the word cache counters of every encoding thread so far
+void bpe_cache_stats(const Bpe *bpe, Bpe_Cache_Stats *stats);
+
+const char *bpe_status_name(Bpe_Status status);
+const char *bpe_stop_name(Bpe_Stop stop);
+
+#endif // BPE_H_
@@ -63,7 +63,10 @@
     } while (0)
 
 #if !defined(_WIN32)
+  #include <errno.h>
   #include <unistd.h>
+  #include <fcntl.h>
+  #include <sys/mman.h>
 #else
   #include <windows.h>
   #include <io.h>
@@ -102,23 +105,87 @@ typedef struct {
   size_t capacity;
 } chaos_arena;
 
+/*
+  Region allocator over a list of chunks that are never moved or freed until chaos_region_free, so every
+  pointer it hands out stays valid as it grows (chaos_arena reallocs a single buffer and cannot promise that).
+  chaos_region_reset rewinds all chunks to empty but keeps them, so a loop that resets once per iteration
+  stops calling malloc as soon as the chunks cover its peak. Chunks start at chunk_size bytes
+  (CHAOS_REGION_CHUNK_SIZE when 0) and each new one is twice the size of the last. chunks counts the mallocs.
+*/
+typedef struct chaos_Region_Chunk {
+  struct chaos_Region_Chunk *next;
+  size_t used;
+  size_t capacity;
+  uint8_t data[];
+} chaos_Region_Chunk;
+
 typedef struct {
-  uint32_t key;
-  char *value;
-  size_t freq;
-} chaos_KV;
+  chaos_Region_Chunk *first;
+  chaos_Region_Chunk *current;
+  size_t chunk_size;
+  size_t chunks;
+} chaos_Region;
+
+typedef uint64_t (*chaos_Map_Hash)(const void *key, size_t key_size);
+typedef bool (*chaos_Map_Eq)(const void *a, const void *b, size_t key_size);
 
+/*
+  Generic hash map over fixed size keys and values. Entries are stored back to back in items, each one
+  being the key followed by the value, in insertion order (a removal moves the last entry into the hole).
+  slots is a linear probing index into items (entry index + 1, 0 meaning empty), and hashes caches the
+  hash of every entry so growing never calls back into the hash function. A NULL hash or eq falls back to
+  hashing and comparing the raw key bytes. Create one with chaos_map_of(Key, Value, hash, eq).
+*/
 typedef struct {
-  chaos_KV *items;
+  size_t key_size;
+  size_t value_size;
+  chaos_Map_Hash hash_fn;
+  chaos_Map_Eq eq_fn;
+
+  uint8_t *items;
   size_t count;
   size_t capacity;
-} chaos_Bucket;
+  uint64_t *hashes;
 
+  size_t *slots;
+  size_t slot_count;
+} chaos_Map;
+
+// Counts how many times each string was appended, a chaos_Map from strdup'ed char * to size_t
 typedef struct {
-  chaos_Bucket *items;
+  chaos_Map map;
+} chaos_Table;
+
+typedef struct {
+  uint64_t key;
+  size_t value;
+} chaos_Pair_KV;
+
+/*
+  Flat open addressing table keyed on a packed (left, right) pair of 32 bit ints, values live inline
+  next to their keys. items holds capacity slots (always a power of two), count the occupied ones, empty
+  slots have key == CHAOS_PAIR_EMPTY. Iterate by walking all capacity slots and skipping the empty ones.
+  Setting region before the first insertion takes the slots from it instead of the heap, the table then
+  never frees anything and dies with the region.
+  With CHAOS_PAIR_TABLE_STATS defined every lookup adds 1 to lookups and the number of slots it looked at
+  to probes, the caller resets them whenever it likes.
+*/
+typedef struct {
+  chaos_Pair_KV *items;
   size_t count;
   size_t capacity;
-} chaos_Table;
+  chaos_Region *region;
+#ifdef CHAOS_PAIR_TABLE_STATS
+  size_t lookups;
+  size_t probes;
+#endif
+} chaos_Pair_Table;
+
+#ifdef CHAOS_PAIR_TABLE_STATS
+  #define CHAOS__PAIR_TABLE_COUNT(t, field) ((t)->field++)
+#else
+  #define CHAOS__PAIR_TABLE_COUNT(t, field) ((void)0)
+#endif
 
 /*
   ======== CONSTANTS ========
@@ -136,12 +203,43 @@ typedef struct {
 #define CHAOS_DA_INIT_CAP 256
 #endif // CHAOS_DA_INIT_CAP
 
+#ifndef CHAOS_REGION_CHUNK_SIZE
+#define CHAOS_REGION_CHUNK_SIZE (64 * 1024)
+#endif // CHAOS_REGION_CHUNK_SIZE
+
+#define CHAOS_REGION_ALIGN 16
+
+#ifndef CHAOS_MAP_INIT_CAP
+#define CHAOS_MAP_INIT_CAP 16
+#endif // CHAOS_MAP_INIT_CAP
+
+#define CHAOS_MAP_MISSING SIZE_MAX
+#define chaos_map_of(K, V, hash, eq) \
+  ((chaos_Map){.key_size = sizeof(K), .value_size = sizeof(V), .hash_fn = (hash), .eq_fn = (eq)})
+
+#ifndef CHAOS_PAIR_TABLE_INIT_CAP
+#define CHAOS_PAIR_TABLE_INIT_CAP 1024
+#endif // CHAOS_PAIR_TABLE_INIT_CAP
+
+#define CHAOS_PAIR_EMPTY UINT64_MAX
+#define chaos_pair_key(left, right) (((uint64_t)(uint32_t)(left) << 32) | (uint32_t)(right))
+#define chaos_pair_left(key) ((int32_t)((key) >> 32))
+#define chaos_pair_right(key) ((int32_t)((key) & 0xffffffffu))
+
 /*
   ======== FILE RELATED UTILITIES =========
 */
 
 CHAOSDEF bool chaos_read_file(char* file_name, Chaos_String_Builder *sb);
 CHAOSDEF bool chaos_write_file(char* file_name, Chaos_String_Builder *sb);
+/*
+  Maps a whole file read-only into memory and points sv at it, no copy is made. The mapping is hinted as
+  read front to back so the kernel reads ahead. An empty file gives an empty sv with NULL data. Release it
+  with chaos_unmap_file. Pipes and devices cannot be mapped, so they are read to the end into anonymous
+  memory instead. Where mmap is missing the file is read into a heap buffer.
+*/
+CHAOSDEF bool chaos_map_file(char* file_name, Chaos_String_View *sv);
+CHAOSDEF void chaos_unmap_file(Chaos_String_View *sv);
 CHAOSDEF bool chaos_does_file_exist(char *filename);
 CHAOSDEF bool chaos_did_file_change(char *filename);
 /*
@@ -188,15 +286,44 @@ CHAOSDEF void chaos_arena_free(chaos_arena *a);
 CHAOSDEF void chaos_arena_reset(chaos_arena *a);
 CHAOSDEF char* chaos_arena_sprintf(chaos_arena *a, const char* fmt, ...);
 
+/*
+  ================= Region functions ==================
+*/
+
+CHAOSDEF void* chaos_region_alloc(chaos_Region *r, size_t size_b);
+CHAOSDEF void* chaos_region_calloc(chaos_Region *r, size_t count, size_t size_b);
+// Like realloc, in place when ptr is the last allocation and its chunk has room, the old copy stays behind
+CHAOSDEF void* chaos_region_grow(chaos_Region *r, void *ptr, size_t old_size_b, size_t new_size_b);
+CHAOSDEF void chaos_region_reset(chaos_Region *r);
+CHAOSDEF void chaos_region_free(chaos_Region *r);
+
 /*
   ================ Hash Table functions ================
 */
 
 CHAOSDEF uint32_t djb33_hash(char *s, size_t len);
 CHAOSDEF uint32_t chaos_hash_generic(char *value, size_t len, uint32_t (*custom_hash)(char *, size_t));
+CHAOSDEF uint64_t chaos_hash_bytes(const void *data, size_t len);
+CHAOSDEF void chaos_map_reserve(chaos_Map *m, size_t n);
+CHAOSDEF size_t chaos_map_find(chaos_Map *m, const void *key);
+CHAOSDEF size_t chaos_map_insert(chaos_Map *m, const void *key, bool *inserted);
+CHAOSDEF void *chaos_map_get(chaos_Map *m, const void *key);
+CHAOSDEF void *chaos_map_key(chaos_Map *m, size_t i);
+CHAOSDEF void *chaos_map_value(chaos_Map *m, size_t i);
+CHAOSDEF bool chaos_map_remove(chaos_Map *m, const void *key);
+CHAOSDEF void chaos_map_clear(chaos_Map *m);
+CHAOSDEF void chaos_map_free(chaos_Map *m);
+
 CHAOSDEF void chaos_table_append(chaos_Table *t, char *value, size_t len);
 CHAOSDEF uint32_t chaos_table_index(chaos_Table *t, char *value, size_t len);
 CHAOSDEF void chaos_table_print(chaos_Table *t);
+CHAOSDEF void chaos_table_free(chaos_Table *t);
+
+CHAOSDEF uint64_t chaos_hash_u64(uint64_t x);
+CHAOSDEF void chaos_pair_table_reserve(chaos_Pair_Table *t, size_t n);
+CHAOSDEF size_t *chaos_pair_table_at(chaos_Pair_Table *t, uint64_t key);
+CHAOSDEF size_t *chaos_pair_table_find(chaos_Pair_Table *t, uint64_t key);
+CHAOSDEF void chaos_pair_table_free(chaos_Pair_Table *t);
 
 #endif // CHAOS_H_
 
@@ -220,6 +347,8 @@ CHAOSDEF void chaos_table_print(chaos_Table *t);
   #define String_View     Chaos_String_View
   #define read_file       chaos_read_file
   #define write_file      chaos_write_file
+  #define map_file        chaos_map_file
+  #define unmap_file      chaos_unmap_file
   #define does_file_exist chaos_does_file_exist
   #define temp_sprintf    chaos_temp_sprintf
   #define sv_from_parts   chaos_sv_from_parts
@@ -243,19 +372,44 @@ CHAOSDEF void chaos_table_print(chaos_Table *t);
   #define arena_free      chaos_arena_free
   #define arena_reset     chaos_arena_reset
   #define arena_sprintf   chaos_arena_sprintf
+  #define Region          chaos_Region
+  #define region_alloc    chaos_region_alloc
+  #define region_calloc   chaos_region_calloc
+  #define region_grow     chaos_region_grow
+  #define region_reset    chaos_region_reset
+  #define region_free     chaos_region_free
   #define sb_to_sv        chaos_sb_to_sv
   #define print           chaos_print
   #define printb          chaos_printb
   #define printv          chaos_printv
   #define sv_to_cstr      chaos_sv_to_cstr
-  #define KV              chaos_KV
-  #define Bucket          chaos_Bucket
+  #define Map             chaos_Map
+  #define map_of          chaos_map_of
+  #define map_reserve     chaos_map_reserve
+  #define map_find        chaos_map_find
+  #define map_insert      chaos_map_insert
+  #define map_get         chaos_map_get
+  #define map_key         chaos_map_key
+  #define map_value       chaos_map_value
+  #define map_remove      chaos_map_remove
+  #define map_clear       chaos_map_clear
+  #define map_free        chaos_map_free
   #define Table           chaos_Table
   #define hash_generic    chaos_hash_generic
   #define hash            chaos_hash
   #define table_append    chaos_table_append
   #define table_index     chaos_table_index
   #define table_print     chaos_table_print
+  #define table_free      chaos_table_free
+  #define Pair_KV         chaos_Pair_KV
+  #define Pair_Table      chaos_Pair_Table
+  #define pair_key        chaos_pair_key
+  #define pair_left       chaos_pair_left
+  #define pair_right      chaos_pair_right
+  #define pair_table_reserve chaos_pair_table_reserve
+  #define pair_table_at   chaos_pair_table_at
+  #define pair_table_find chaos_pair_table_find
+  #define pair_table_free chaos_pair_table_free
 #endif
 
 
@@ -281,19 +435,29 @@ CHAOSDEF bool chaos_read_file(char* file_name, Chaos_String_Builder *sb)
 
   size_t new_count = 0;
   
-  if (fseek(f, 0, SEEK_END) < 0) return false;
-  
-  size_t m = ftell(f);
+  long end = -1;
+  if (fseek(f, 0, SEEK_END) == 0) end = ftell(f);
+  if (end < 0 || fseek(f, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "Cannot get size of file <%s>\n", file_name);
+    fclose(f);
+    return false;
+  }
+
+  size_t m = (size_t)end;
 
   new_count = sb->count + m;
 
   if (new_count > sb->capacity){
     sb->items = CHAOS_REALLOC(sb->items, new_count * sizeof(char));
+    CHAOS_ASSERT(sb->items != NULL && "Buy more RAM lol");
     sb->capacity = new_count;
   }
   
-  fseek(f, 0, SEEK_SET);
-  fread(sb->items + sb->count, 1, m, f);
+  if (fread(sb->items + sb->count, 1, m, f) != m) {
+    fprintf(stderr, "Cannot read file <%s>\n", file_name);
+    fclose(f);
+    return false;
+  }
 
   if (fclose(f) != 0) {
     fprintf(stderr, "Cannot close file <%s>\n", file_name);
@@ -305,6 +469,109 @@ CHAOSDEF bool chaos_read_file(char* file_name, Chaos_String_Builder *sb)
 }
 
 
+#if !defined(_WIN32)
+// Reads fd to the end into anonymous pages, doubling them as it goes, and
+// gives back the pages past the data so munmap of count bytes frees it all
+static bool chaos__map_stream(int fd, Chaos_String_View *sv)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t capacity = 0, count = 0;
+  char *data = NULL;
+
+  for (;;) {
+    if (count == capacity) {
+      size_t grown = capacity ? capacity * 2 : (size_t)1 << 20;
+      char *bigger = mmap(NULL, grown, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (bigger == MAP_FAILED) {
+        if (data) munmap(data, capacity);
+        return false;
+      }
+      if (data) {
+        memcpy(bigger, data, count);
+        munmap(data, capacity);
+      }
+      data = bigger;
+      capacity = grown;
+    }
+
+    ssize_t got = read(fd, data + count, capacity - count);
+    if (got == 0) break;
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      munmap(data, capacity);
+      return false;
+    }
+    count += (size_t)got;
+  }
+
+  size_t used = (count + page - 1) / page * page;
+  if (used < capacity) munmap(data + used, capacity - used);
+  sv->data = count ? data : NULL;
+  sv->count = count;
+  return true;
+}
+#endif
+
+CHAOSDEF bool chaos_map_file(char* file_name, Chaos_String_View *sv)
+{
+#if !defined(_WIN32)
+  int fd = open(file_name, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open file: <%s>\n", file_name);
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "Cannot get size of file <%s>\n", file_name);
+    close(fd);
+    return false;
+  }
+
+  *sv = (Chaos_String_View){0};
+  if (!S_ISREG(st.st_mode)) {
+    bool ok = chaos__map_stream(fd, sv);
+    if (!ok) fprintf(stderr, "Cannot read file <%s>\n", file_name);
+    close(fd);
+    return ok;
+  }
+  if (st.st_size > 0) {
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      fprintf(stderr, "Cannot map file <%s>\n", file_name);
+      close(fd);
+      return false;
+    }
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+    sv->data = data;
+    sv->count = (size_t)st.st_size;
+  }
+
+  // The mapping stays valid once the descriptor is gone
+  close(fd);
+  return true;
+#else
+  Chaos_String_Builder sb = {0};
+  if (!chaos_read_file(file_name, &sb)) {
+    CHAOS_FREE(sb.items);
+    return false;
+  }
+  sv->data = sb.items;
+  sv->count = sb.count;
+  return true;
+#endif
+}
+
+CHAOSDEF void chaos_unmap_file(Chaos_String_View *sv)
+{
+#if !defined(_WIN32)
+  if (sv->data) munmap((void *)sv->data, sv->count);
+#else
+  CHAOS_FREE((void *)sv->data);
+#endif
+  *sv = (Chaos_String_View){0};
+}
+
 CHAOSDEF bool chaos_write_file(char* file_name, Chaos_String_Builder *sb)
 { 
   FILE *f = fopen(file_name, "wb");
@@ -529,7 +796,7 @@ CHAOSDEF bool chaos_cmd_run(Chaos_cmd_arr *arr) {
   int ret = system(cmd);
   if (ret == -1) perror("system");
 
-  free(cmd);
+  CHAOS_FREE(cmd);
   arr->count = 0;
   
   return ret == 0; 
@@ -659,6 +926,80 @@ CHAOSDEF char* chaos_arena_sprintf(chaos_arena *a, const char* fmt, ...){
   return buf;
 }
 
+static void *chaos__region_take(chaos_Region_Chunk *c, size_t size_b) {
+  uintptr_t base = (uintptr_t)c->data;
+  uintptr_t at = (base + c->used + CHAOS_REGION_ALIGN - 1) & ~(uintptr_t)(CHAOS_REGION_ALIGN - 1);
+  if (at - base + size_b > c->capacity) return NULL;
+  c->used = at - base + size_b;
+  return (void *)at;
+}
+
+CHAOSDEF void* chaos_region_alloc(chaos_Region *r, size_t size_b){
+  if (size_b == 0) size_b = 1;
+
+  chaos_Region_Chunk *last = NULL;
+  for (chaos_Region_Chunk *c = r->current; c; c = c->next) {
+    void *p = chaos__region_take(c, size_b);
+    if (p) {
+      r->current = c;
+      return p;
+    }
+    last = c;
+  }
+
+  size_t capacity = r->chunk_size ? r->chunk_size : CHAOS_REGION_CHUNK_SIZE;
+  if (last && last->capacity * 2 > capacity) capacity = last->capacity * 2;
+  if (size_b + CHAOS_REGION_ALIGN > capacity) capacity = size_b + CHAOS_REGION_ALIGN;
+
+  chaos_Region_Chunk *c = CHAOS_REALLOC(NULL, sizeof(*c) + capacity);
+  CHAOS_ASSERT(c != NULL && "Buy more RAM lol");
+  c->next = NULL;
+  c->used = 0;
+  c->capacity = capacity;
+  r->chunks++;
+
+  if (last) last->next = c;
+  else r->first = c;
+  r->current = c;
+  return chaos__region_take(c, size_b);
+}
+
+CHAOSDEF void* chaos_region_calloc(chaos_Region *r, size_t count, size_t size_b){
+  void *p = chaos_region_alloc(r, count * size_b);
+  memset(p, 0, count * size_b);
+  return p;
+}
+
+CHAOSDEF void* chaos_region_grow(chaos_Region *r, void *ptr, size_t old_size_b, size_t new_size_b){
+  chaos_Region_Chunk *c = r->current;
+  if (ptr && c && (uint8_t *)ptr + old_size_b == c->data + c->used &&
+      (size_t)((uint8_t *)ptr - c->data) + new_size_b <= c->capacity) {
+    c->used = (size_t)((uint8_t *)ptr - c->data) + new_size_b;
+    return ptr;
+  }
+
+  void *p = chaos_region_alloc(r, new_size_b);
+  if (ptr) memcpy(p, ptr, old_size_b < new_size_b ? old_size_b : new_size_b);
+  return p;
+}
+
+CHAOSDEF void chaos_region_reset(chaos_Region *r){
+  for (chaos_Region_Chunk *c = r->first; c; c = c->next) c->used = 0;
+  r->current = r->first;
+}
+
+CHAOSDEF void chaos_region_free(chaos_Region *r){
+  chaos_Region_Chunk *c = r->first;
+  while (c) {
+    chaos_Region_Chunk *next = c->next;
+    CHAOS_FREE(c);
+    c = next;
+  }
+  r->first = NULL;
+  r->current = NULL;
+  r->chunks = 0;
+}
+
 CHAOSDEF uint32_t djb33_hash(char *s, size_t len) {
   uint32_t h = 5381;
   while (len--) {
@@ -674,55 +1015,296 @@ CHAOSDEF uint32_t chaos_hash_generic(char *value, size_t len,
 }
 
 
-CHAOSDEF void chaos_table_append(chaos_Table *t, char *value, size_t len) {
-  if (t->items == NULL) {
-    t->count = 16;
-    t->items = calloc(t->count, sizeof(chaos_Bucket));
+#define CHAOS__MAP_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+static size_t chaos__map_stride(chaos_Map *m) {
+  return CHAOS__MAP_ALIGN(m->key_size) + CHAOS__MAP_ALIGN(m->value_size);
+}
+
+static uint64_t chaos__map_hash(chaos_Map *m, const void *key) {
+  if (m->hash_fn) return m->hash_fn(key, m->key_size);
+  return chaos_hash_bytes(key, m->key_size);
+}
+
+static bool chaos__map_eq(chaos_Map *m, const void *a, const void *b) {
+  if (m->eq_fn) return m->eq_fn(a, b, m->key_size);
+  return memcmp(a, b, m->key_size) == 0;
+}
+
+static void chaos__map_place(chaos_Map *m, size_t entry) {
+  size_t mask = m->slot_count - 1;
+  size_t i = m->hashes[entry] & mask;
+  while (m->slots[i]) i = (i + 1) & mask;
+  m->slots[i] = entry + 1;
+}
+
+// Slot of the entry matching key, or of the empty slot where it would go
+static size_t chaos__map_slot(chaos_Map *m, const void *key, uint64_t h) {
+  size_t mask = m->slot_count - 1;
+  size_t i = h & mask;
+
+  while (m->slots[i]) {
+    size_t e = m->slots[i] - 1;
+    if (m->hashes[e] == h && chaos__map_eq(m, chaos_map_key(m, e), key)) break;
+    i = (i + 1) & mask;
+  }
+  return i;
+}
+
+CHAOSDEF uint64_t chaos_hash_bytes(const void *data, size_t len) {
+  const uint8_t *p = data;
+  uint64_t h = 0xcbf29ce484222325ULL;
+  while (len--) {
+    h ^= *p++;
+    h *= 0x100000001b3ULL;
   }
+  return chaos_hash_u64(h);
+}
+
+// Makes room for n entries without any further allocation or rehashing
+CHAOSDEF void chaos_map_reserve(chaos_Map *m, size_t n) {
+  if (n > m->capacity) {
+    size_t capacity = m->capacity ? m->capacity : CHAOS_MAP_INIT_CAP;
+    while (n > capacity) capacity *= 2;
 
-  uint32_t key = chaos_hash(value, len);
-  chaos_Bucket *bucket = &t->items[key % t->count];
+    m->items = CHAOS_REALLOC(m->items, capacity * chaos__map_stride(m));
+    m->hashes = CHAOS_REALLOC(m->hashes, capacity * sizeof(uint64_t));
+    CHAOS_ASSERT(m->items != NULL && m->hashes != NULL && "Buy more RAM lol");
+    m->capacity = capacity;
+  }
 
-  chaos_KV *found = NULL;
+  if (n * 4 > m->slot_count * 3) {
+    size_t slot_count = m->slot_count ? m->slot_count : CHAOS_MAP_INIT_CAP;
+    while (n * 4 > slot_count * 3) slot_count *= 2;
 
-  for (size_t i = 0; i < bucket->count; ++i) {
-    chaos_KV *kv = &bucket->items[i];
+    CHAOS_FREE(m->slots);
+    m->slots = CHAOS_REALLOC(NULL, slot_count * sizeof(size_t));
+    CHAOS_ASSERT(m->slots != NULL && "Buy more RAM lol");
+    memset(m->slots, 0, slot_count * sizeof(size_t));
+    m->slot_count = slot_count;
 
-    if (kv->key == key && strcmp(kv->value, value) == 0) {
-      found = kv;
-      break;
-    }
+    for (size_t e = 0; e < m->count; ++e) chaos__map_place(m, e);
   }
+}
 
-  if (found) {
-    found->freq++;
-  } else {
-    chaos_da_append(bucket, ((chaos_KV){
-                                .key = key,
-                                .value = strdup(value),
-                                .freq = 1,
-                            }));
+CHAOSDEF size_t chaos_map_find(chaos_Map *m, const void *key) {
+  if (m->slot_count == 0) return CHAOS_MAP_MISSING;
+
+  size_t i = chaos__map_slot(m, key, chaos__map_hash(m, key));
+  return m->slots[i] ? m->slots[i] - 1 : CHAOS_MAP_MISSING;
+}
+
+// Index of the entry for key, appending one with a zeroed value first if it is missing
+CHAOSDEF size_t chaos_map_insert(chaos_Map *m, const void *key, bool *inserted) {
+  chaos_map_reserve(m, m->count + 1);
+
+  uint64_t h = chaos__map_hash(m, key);
+  size_t i = chaos__map_slot(m, key, h);
+
+  if (inserted) *inserted = m->slots[i] == 0;
+  if (m->slots[i]) return m->slots[i] - 1;
+
+  size_t e = m->count++;
+  memcpy(chaos_map_key(m, e), key, m->key_size);
+  memset(chaos_map_value(m, e), 0, m->value_size);
+  m->hashes[e] = h;
+  m->slots[i] = e + 1;
+  return e;
+}
+
+CHAOSDEF void *chaos_map_get(chaos_Map *m, const void *key) {
+  size_t e = chaos_map_find(m, key);
+  return e == CHAOS_MAP_MISSING ? NULL : chaos_map_value(m, e);
+}
+
+CHAOSDEF void *chaos_map_key(chaos_Map *m, size_t i) {
+  return m->items + i * chaos__map_stride(m);
+}
+
+CHAOSDEF void *chaos_map_value(chaos_Map *m, size_t i) {
+  return m->items + i * chaos__map_stride(m) + CHAOS__MAP_ALIGN(m->key_size);
+}
+
+CHAOSDEF bool chaos_map_remove(chaos_Map *m, const void *key) {
+  if (m->slot_count == 0) return false;
+
+  size_t mask = m->slot_count - 1;
+  size_t i = chaos__map_slot(m, key, chaos__map_hash(m, key));
+  if (!m->slots[i]) return false;
+
+  size_t e = m->slots[i] - 1;
+
+  // Backward shift deletion, pulls every displaced follower closer to its home slot
+  for (size_t j = i;;) {
+    j = (j + 1) & mask;
+    if (!m->slots[j]) break;
+
+    size_t home = m->hashes[m->slots[j] - 1] & mask;
+    bool stays = i <= j ? (i < home && home <= j) : (i < home || home <= j);
+    if (stays) continue;
+
+    m->slots[i] = m->slots[j];
+    i = j;
+  }
+  m->slots[i] = 0;
+
+  size_t last = --m->count;
+  if (e != last) {
+    size_t s = m->hashes[last] & mask;
+    while (m->slots[s] != last + 1) s = (s + 1) & mask;
+    m->slots[s] = e + 1;
+
+    memcpy(chaos_map_key(m, e), chaos_map_key(m, last), chaos__map_stride(m));
+    m->hashes[e] = m->hashes[last];
+  }
+  return true;
+}
+
+CHAOSDEF void chaos_map_clear(chaos_Map *m) {
+  m->count = 0;
+  if (m->slots) memset(m->slots, 0, m->slot_count * sizeof(size_t));
+}
+
+CHAOSDEF void chaos_map_free(chaos_Map *m) {
+  CHAOS_FREE(m->items);
+  CHAOS_FREE(m->hashes);
+  CHAOS_FREE(m->slots);
+  m->items = NULL;
+  m->hashes = NULL;
+  m->slots = NULL;
+  m->count = 0;
+  m->capacity = 0;
+  m->slot_count = 0;
+}
+
+static uint64_t chaos__cstr_hash(const void *key, size_t key_size) {
+  (void)key_size;
+  char *s = *(char **)key;
+  return djb33_hash(s, strlen(s));
+}
+
+static bool chaos__cstr_eq(const void *a, const void *b, size_t key_size) {
+  (void)key_size;
+  return strcmp(*(char **)a, *(char **)b) == 0;
+}
+
+CHAOSDEF void chaos_table_append(chaos_Table *t, char *value, size_t len) {
+  (void)len;
+  if (t->map.key_size == 0) t->map = chaos_map_of(char *, size_t, chaos__cstr_hash, chaos__cstr_eq);
+
+  bool inserted;
+  size_t e = chaos_map_insert(&t->map, &value, &inserted);
+  if (inserted) {
+    size_t n = strlen(value) + 1;
+    char *copy = CHAOS_REALLOC(NULL, n);
+    CHAOS_ASSERT(copy != NULL && "Buy more RAM lol");
+    memcpy(copy, value, n);
+    *(char **)chaos_map_key(&t->map, e) = copy;
   }
+  (*(size_t *)chaos_map_value(&t->map, e))++;
 }
 
 CHAOSDEF uint32_t chaos_table_index(chaos_Table *t, char *value, size_t len) {
-  return chaos_hash(value, len) % t->count;
+  (void)len;
+  if (t->map.key_size == 0) return UINT32_MAX;
+  return (uint32_t)chaos_map_find(&t->map, &value);
 }
 
 CHAOSDEF void chaos_table_print(chaos_Table *t) {
-  for (size_t i = 0; i < t->count; ++i) {
-    chaos_Bucket *b = &t->items[i];
+  for (size_t i = 0; i < t->map.count; ++i) {
+    char *value = *(char **)chaos_map_key(&t->map, i);
+    printf("value = %s\n", value);
+    printf("key = %u\n", (uint32_t)t->map.hashes[i]);
+    printf("freq %zu\n", *(size_t *)chaos_map_value(&t->map, i));
+    printf("-----------\n");
+  }
+}
 
-    if (b->count == 0)
-      continue;
+CHAOSDEF void chaos_table_free(chaos_Table *t) {
+  for (size_t i = 0; i < t->map.count; ++i) {
+    CHAOS_FREE(*(char **)chaos_map_key(&t->map, i));
+  }
+  chaos_map_free(&t->map);
+}
+
+CHAOSDEF uint64_t chaos_hash_u64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  x *= 0xc4ceb9fe1a85ec53ULL;
+  x ^= x >> 33;
+  return x;
+}
+
+CHAOSDEF void chaos_pair_table_reserve(chaos_Pair_Table *t, size_t n) {
+  size_t capacity = t->capacity ? t->capacity : CHAOS_PAIR_TABLE_INIT_CAP;
+  while (n * 4 > capacity * 3) capacity *= 2;
+  if (capacity == t->capacity) return;
+
+  chaos_Pair_KV *items = t->region ? chaos_region_alloc(t->region, capacity * sizeof(chaos_Pair_KV))
+                                    : CHAOS_REALLOC(NULL, capacity * sizeof(chaos_Pair_KV));
+  CHAOS_ASSERT(items != NULL && "Buy more RAM lol");
+  for (size_t i = 0; i < capacity; ++i) items[i].key = CHAOS_PAIR_EMPTY;
+
+  for (size_t i = 0; i < t->capacity; ++i) {
+    if (t->items[i].key == CHAOS_PAIR_EMPTY) continue;
+
+    size_t j = chaos_hash_u64(t->items[i].key) & (capacity - 1);
+    while (items[j].key != CHAOS_PAIR_EMPTY) j = (j + 1) & (capacity - 1);
+    items[j] = t->items[i];
+  }
 
-    for (size_t j = 0; j < b->count; ++j) {
-      printf("value = %s\n", b->items[j].value);
-      printf("key = %u\n", b->items[j].key);
-      printf("freq %zu\n", b->items[j].freq);
-      printf("-----------\n");
+  if (!t->region) CHAOS_FREE(t->items);
+  t->items = items;
+  t->capacity = capacity;
+}
+
+// Returns the value stored for key, inserting it as 0 first if it is missing. The pointer is only good until
+// the next insertion, which may move every slot.
+CHAOSDEF size_t *chaos_pair_table_at(chaos_Pair_Table *t, uint64_t key) {
+  CHAOS_ASSERT(key != CHAOS_PAIR_EMPTY);
+  chaos_pair_table_reserve(t, t->count + 1);
+
+  size_t mask = t->capacity - 1;
+  size_t i = chaos_hash_u64(key) & mask;
+  CHAOS__PAIR_TABLE_COUNT(t, lookups);
+  CHAOS__PAIR_TABLE_COUNT(t, probes);
+
+  while (t->items[i].key != key) {
+    if (t->items[i].key == CHAOS_PAIR_EMPTY) {
+      t->items[i].key = key;
+      t->items[i].value = 0;
+      t->count++;
+      break;
     }
+    i = (i + 1) & mask;
+    CHAOS__PAIR_TABLE_COUNT(t, probes);
   }
+
+  return &t->items[i].value;
+}
+
+CHAOSDEF size_t *chaos_pair_table_find(chaos_Pair_Table *t, uint64_t key) {
+  if (t->capacity == 0) return NULL;
+
+  size_t mask = t->capacity - 1;
+  size_t i = chaos_hash_u64(key) & mask;
+  CHAOS__PAIR_TABLE_COUNT(t, lookups);
+  CHAOS__PAIR_TABLE_COUNT(t, probes);
+
+  while (t->items[i].key != CHAOS_PAIR_EMPTY) {
+    if (t->items[i].key == key) return &t->items[i].value;
+    i = (i + 1) & mask;
+    CHAOS__PAIR_TABLE_COUNT(t, probes);
+  }
+  return NULL;
+}
+
+CHAOSDEF void chaos_pair_table_free(chaos_Pair_Table *t) {
+  if (!t->region) CHAOS_FREE(t->items);
+  t->items = NULL;
+  t->count = 0;
+  t->capacity = 0;
 }
 #endif // CHAOS_IMPLEMENTATION
 
@@ -0,0 +1,3814 @@
+// The engine behind bpe.h, the bpe CLI in bpe.c is one user of it. chaos.h is
+// compiled in privately, so programs linking this can bring their own.
+#include "bpe.h"
+
+// Built with -DBPE_STATS, --stats writes a JSONL trace of every training
+// iteration. Without it the trace compiles away to nothing.
+#ifdef BPE_STATS
+#include <stdlib.h>
+static size_t stats_allocs = 0;
+static void *stats_realloc(void *ptr, size_t size) {
+  __atomic_fetch_add(&stats_allocs, 1, __ATOMIC_RELAXED);
+  return realloc(ptr, size);
+}
+#define CHAOS_REALLOC stats_realloc
+#define CHAOS_PAIR_TABLE_STATS
+#define STATS_ENABLED 1
+#else
+#define STATS_ENABLED 0
+#endif
+
+#define CHAOSDEF static inline
+#define CHAOS_IMPLEMENTATION
+#include <chaos.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define NO_POS SIZE_MAX
+#define DEAD_TOKEN -1
+// Sits between words when training on them, no pair is ever formed with it
+#define WORD_BREAK -2
+
+// Below this many tokens per thread, spawning threads costs more than it saves
+#define MIN_SHARD_TOKENS 4096
+
+// Streaming training reads its inputs this many bytes at a time
+#define STREAM_CHUNK (1 << 20)
+// Word bytes are copied into blocks of at least this size, so they never move
+#define POOL_BLOCK (1 << 20)
+
+// Model files and checkpoints are written and mmapped in host byte order and
+// documented as little endian, so only little endian hosts can share them
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "bpe model files are little endian, big endian hosts are not supported"
+#endif
+
+#define MODEL_MAGIC "SBPE"
+#define MODEL_VERSION 2
+
+#define CHECKPOINT_MAGIC "SBPC"
+#define CHECKPOINT_VERSION 1
+
+// Periodic snapshots of a training run, written every `every` merges and/or
+// `seconds` seconds to path, and read back from resume. fingerprint, saved
+// and time describe the run in progress.
+typedef struct {
+  char *path;
+  size_t every;
+  double seconds;
+  char *resume;
+  uint64_t fingerprint;
+  size_t saved;
+  double time;
+} Checkpoint;
+
+// Which cached word makes room when the bucket of a new one is full: the one
+// used longest ago or the one stored first. Same order as Bpe_Cache_Policy.
+typedef enum {
+  CACHE_LRU,
+  CACHE_FIFO,
+} Cache_Policy;
+
+// The --stats trace file, length is the live token count of the training
+// stream and allocs the allocation counter at the last record.
+typedef struct {
+  char *path;
+  FILE *file;
+  size_t iteration;
+  size_t length;
+  size_t allocs;
+  double started;
+} Trace;
+
+typedef struct {
+  bool reference;
+  bool words;
+  size_t cache_size;
+  Cache_Policy cache_policy;
+  size_t threads;
+  size_t memory;
+  int vocab_size;
+  size_t min_frequency;
+  double max_seconds;
+  double started;
+  Checkpoint checkpoint;
+  Trace trace;
+  Bpe_Log log;
+  void *log_user;
+  struct Specials *specials;
+} Config;
+
+// Why training stopped. STOP_DONE means no pair occurs twice any more, the
+// others are the limits of Config. Same order as Bpe_Stop.
+typedef enum {
+  STOP_NONE,
+  STOP_DONE,
+  STOP_VOCAB_SIZE,
+  STOP_MIN_FREQUENCY,
+  STOP_MAX_SECONDS,
+  STOP_FAILED,
+} Stop;
+
+static const char *stop_names[] = {
+    [STOP_NONE] = "none",
+    [STOP_DONE] = "no pair occurs twice",
+    [STOP_VOCAB_SIZE] = "vocab size reached",
+    [STOP_MIN_FREQUENCY] = "best pair below min frequency",
+    [STOP_MAX_SECONDS] = "out of time",
+    [STOP_FAILED] = "failed",
+};
+
+typedef struct {
+  char **items;
+  size_t count;
+  size_t capacity;
+} Paths;
+
+typedef struct {
+  String_View *items;
+  size_t count;
+  size_t capacity;
+} Views;
+
+typedef struct {
+  int *items;
+  size_t count;
+  size_t capacity;
+} Tokens;
+
+// Ids as stored in the corpus wide arrays of training and encoding, offset by
+// this much so DEAD_TOKEN and WORD_BREAK land on 1 and 0
+#define SYMBOL_BIAS 2
+// Largest id a narrow Symbols can hold
+#define NARROW_MAX (UINT16_MAX - SYMBOL_BIAS)
+
+// Token ids packed as uint16_t while they all fit, which halves the bytes the
+// pair counting and merge loops stream through, and as uint32_t once an id
+// goes past NARROW_MAX. Read and write them with sym_get and sym_set, loops
+// over the whole array branch on wide once and run on the raw items.
+typedef struct {
+  void *items;
+  size_t count;
+  size_t capacity;
+  bool wide;
+} Symbols;
+
+typedef struct {
+  int left;
+  int right;
+  int token;
+} Merge;
+
+typedef struct {
+  Merge *items;
+  size_t count;
+  size_t capacity;
+} Merges;
+
+typedef struct {
+  size_t *items;
+  size_t count;
+  size_t capacity;
+} Positions;
+
+typedef struct {
+  uint32_t *items;
+  size_t count;
+  size_t capacity;
+} Offsets;
+
+// Model file layout, all integers little endian:
+//   Model_Header
+//   Model_Merge merges[merge_count]   token 256 + i is merges[i]
+//   uint32_t offsets[vocab_count +    bytes of token id are
+//                    special_count + 1]
+//   uint8_t bytes[vocab_bytes]         bytes[offsets[id]..offsets[id + 1]]
+// Special tokens follow the merged ones, special i being token
+// vocab_count + i. Version 1 files end their header before special_count
+// and have none. checksum is chaos_hash_bytes of everything after the header.
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t merge_count;
+  uint32_t vocab_count;
+  uint64_t vocab_bytes;
+  uint64_t checksum;
+  uint32_t special_count;
+  uint32_t reserved;
+} Model_Header;
+
+#define MODEL_HEADER_V1 offsetof(Model_Header, special_count)
+
+typedef struct {
+  int32_t left;
+  int32_t right;
+} Model_Merge;
+
+// Checkpoint file layout, little endian like the model:
+//   Checkpoint_Header
+//   Model_Merge merges[merge_count]
+//   int32_t tokens[token_count]       the live token stream, WORD_BREAK kept
+// fingerprint hashes the stream training started from, so a checkpoint only
+// resumes the run it was taken from. checksum covers everything after the
+// header.
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t merge_count;
+  uint32_t reserved;
+  uint64_t token_count;
+  uint64_t fingerprint;
+  uint64_t checksum;
+} Checkpoint_Header;
+
+// A model as laid out in its file. A loaded one points straight into the
+// mapping, nothing is parsed or copied.
+typedef struct {
+  uint32_t merge_count;
+  uint32_t vocab_count;
+  uint32_t special_count;
+  const Model_Merge *merges;
+  const uint32_t *offsets;
+  const uint8_t *bytes;
+  void *mapping;
+  size_t mapping_size;
+} Model;
+
+#define NO_SPECIAL UINT32_MAX
+
+// A state of the Aho-Corasick automaton over the special tokens spelled back
+// to front, depth bytes from the end of some of them. Its children are listed
+// from child on through sibling. fail is the state of its longest proper
+// suffix, and out the longest token ending in it: token if it ends one, else
+// the out of fail, NO_SPECIAL when there is none. Fed text backwards, that is
+// the longest token starting at the byte just read.
+typedef struct {
+  uint32_t child;
+  uint32_t sibling;
+  uint32_t fail;
+  uint32_t out;
+  uint32_t depth;
+  uint32_t token;
+  uint8_t byte;
+} Special_Node;
+
+typedef struct {
+  Special_Node *items;
+  size_t count;
+  size_t capacity;
+} Special_Nodes;
+
+// Special tokens, token i spanning bytes[offsets[i]..offsets[i + 1]], and
+// the automaton finding them, state 0 being the root. last marks the bytes a
+// token ends with and single is that byte when there is only one, so text
+// without any is passed over with memchr.
+typedef struct Specials {
+  Offsets offsets;
+  String_Builder bytes;
+  Special_Nodes nodes;
+  uint32_t root[256];
+  bool last[256];
+  int single;
+  size_t longest;
+} Specials;
+
+// Text is searched for special tokens this many bytes at a time, or longest
+// bytes when a token is longer
+#define SPECIALS_BLOCK 4096
+
+typedef struct {
+  size_t at;
+  uint32_t token;
+} Special_Hit;
+
+typedef struct {
+  Special_Hit *items;
+  size_t count;
+  size_t capacity;
+} Special_Hits;
+
+// A search for special tokens through s[0..n). Everything before end has been
+// searched, and hits holds the longest token at every byte where one starts
+// that was not handed out yet, leftmost last.
+typedef struct {
+  const Specials *sp;
+  const char *s;
+  size_t n;
+  size_t end;
+  Special_Hits hits;
+} Special_Scan;
+
+// Turns text into tokens of a model by merge rank, lowest rank first, which
+// gives the same tokens as replaying the merges in training order. Read only
+// once built, so several threads may share one. cache_size is the number of
+// words each thread's Scratch remembers the tokens of, 0 turning that off.
+// Special tokens of the model are matched before any of that and come out
+// as their own id. Bit y of joins[x] is set when some merge puts a token
+// ending in byte x before one starting with byte y. Between bytes where it is
+// not, no token can ever form, so raw text is encoded a piece at a time.
+typedef struct {
+  Model *model;
+  Specials specials;
+  uint64_t joins[256][4];
+  Pair_Table ranks;
+  size_t cache_size;
+  Cache_Policy cache_policy;
+} Encoder;
+
+// A position whose pair with the next token may merge, chained to the other
+// sites of the same merge rank. Still valid as long as the tokens at pos and
+// after it are the left and right of that merge.
+typedef struct {
+  size_t pos;
+  size_t next;
+} Site;
+
+typedef struct {
+  Site *items;
+  size_t count;
+  size_t capacity;
+} Sites;
+
+typedef struct {
+  uint32_t *items;
+  size_t count;
+  size_t capacity;
+} Ranks;
+
+// Only words this short that encode to this few tokens get cached, so an
+// entry fits in a fixed slot
+#define CACHE_WORD 32
+#define CACHE_TOKENS 8
+// Slots a word may live in, the bucket its hash picks
+#define CACHE_WAYS 4
+// Words cached per thread unless --cache says otherwise
+#define ENCODE_CACHE 8192
+
+// hash is never 0 for a used slot. stamp is the tick of the last hit (LRU)
+// or of the insertion (FIFO), the oldest one of a full bucket gets evicted.
+typedef struct {
+  uint64_t hash;
+  uint32_t stamp;
+  uint8_t length;
+  uint8_t count;
+  char bytes[CACHE_WORD];
+  int32_t tokens[CACHE_TOKENS];
+} Cache_Slot;
+
+// Word bytes to their tokens, open addressing over buckets of CACHE_WAYS
+// slots. One per Scratch, so threads never share one.
+typedef struct {
+  Cache_Slot *slots;
+  size_t capacity;
+  uint32_t tick;
+  size_t hits;
+  size_t misses;
+  size_t evictions;
+} Cache;
+
+// Per thread buffers of an encoder, reused from one call to the next. heads
+// holds one chain of sites per merge rank (index + 1 into sites, 0 meaning
+// empty) and is left all zero after every call.
+typedef struct {
+  Symbols symbols;
+  Positions prev;
+  Positions next;
+  Sites sites;
+  size_t *heads;
+  Ranks pending;
+  Positions batch;
+  Cache cache;
+  Special_Scan specials;
+} Scratch;
+
+// Where the tokens of one document of a batch were left by the worker that
+// encoded it
+typedef struct {
+  size_t worker;
+  size_t start;
+  size_t count;
+} Batch_Doc;
+
+typedef struct {
+  Batch_Doc *items;
+  size_t count;
+  size_t capacity;
+} Batch_Docs;
+
+struct Batch;
+
+// One thread of a batch. Its chunks of documents are [next, end), taken one
+// at a time by it and by any worker that ran out of its own.
+typedef struct {
+  struct Batch *batch;
+  size_t id;
+  size_t next;
+  size_t end;
+  Scratch scratch;
+  Tokens out;
+} Batch_Worker;
+
+// Encodes many documents at once. The tokens of document d are gathered to
+// [offsets.items[d], offsets.items[d + 1]) of the output in the same order
+// whatever the thread count. Every buffer is kept from one call to the next,
+// so once they have grown a batch allocates nothing per document.
+typedef struct Batch {
+  Encoder *encoder;
+  bool words;
+  size_t threads;
+  const String_View *inputs;
+  size_t input_count;
+  Batch_Worker *workers;
+  Batch_Docs docs;
+  Positions offsets;
+  Region region;
+} Batch;
+
+// The bytes of every token back to back, token id spanning
+// bytes[offsets[id]..offsets[id + 1]]
+typedef struct {
+  Offsets offsets;
+  String_Builder bytes;
+} Vocab;
+
+// Read-only view of a token table, either a Vocab or a loaded Model, so
+// decoding a token is a single copy of its span.
+typedef struct {
+  const uint32_t *offsets;
+  const uint8_t *bytes;
+  size_t vocab_count;
+} Decoder;
+
+typedef struct {
+  size_t *items;
+  size_t count;
+  size_t capacity;
+} Word_Ids;
+
+// Every distinct word of a corpus mapped to how often it occurs, with the
+// entry index of a word in counts doubling as its id.
+typedef struct {
+  Map counts;
+  Word_Ids order;
+} Words;
+
+// Blocks of copied bytes. used is how much of the last block is taken and
+// bytes the total handed out.
+typedef struct {
+  char **items;
+  size_t count;
+  size_t capacity;
+  size_t used;
+  size_t size;
+  size_t bytes;
+} Pool;
+
+typedef struct {
+  FILE **items;
+  size_t count;
+  size_t capacity;
+} Runs;
+
+// Word counts gathered from inputs that are never held whole in memory, the
+// words themselves living in pool. Once counts outgrow budget bytes they are
+// sorted and spilled to a run file, and the runs are merged back at the end.
+// The budget only bounds collecting: the merged runs are all held for
+// training, as is any single word, however long.
+typedef struct {
+  Map counts;
+  Pool pool;
+  Runs runs;
+  const Specials *specials;
+  size_t budget;
+  size_t words;
+  size_t bytes;
+  size_t special_hits;
+} Stream;
+
+typedef struct {
+  String_View word;
+  size_t count;
+} Word_Count;
+
+typedef struct {
+  int left;
+  int right;
+  size_t freq;
+  size_t heap_index;
+  Positions where;
+} Pair;
+
+// Every pair ever seen lives in items, index maps its packed key to its
+// position in items plus one. Pairs are never removed, their freq just drops
+// to 0 once they stop occurring.
+typedef struct {
+  Pair *items;
+  size_t count;
+  size_t capacity;
+  Pair_Table index;
+} Pairs;
+
+// Indexed binary max-heap of pair ids, holding every pair with a non zero
+// freq. Each pair knows its own slot, so a count change is a single sift.
+typedef struct {
+  size_t *items;
+  size_t count;
+  size_t capacity;
+} Heap;
+
+// One thread's slice [begin, end) of the token array. It owns every pair
+// starting inside the slice, including the one straddling end. A slice of
+// bytes only is counted into dense, BYTE_SYMBOLS x BYTE_SYMBOLS counts
+// indexed by the stored symbols, instead of pairs.
+typedef struct {
+  const Symbols *tokens;
+  size_t begin;
+  size_t end;
+  Pair_Table pairs;
+  uint64_t *dense;
+  size_t **cursors;
+} Shard;
+
+// One thread's slice [begin, end) of a merge rewrite. The slice compacts
+// itself in place, first_taken and last_merges say whether the pairs
+// straddling its two edges merge, decided before any thread writes.
+typedef struct {
+  Symbols *tokens;
+  size_t begin;
+  size_t end;
+  int left;
+  int right;
+  int token;
+  bool first_taken;
+  bool last_merges;
+  size_t written;
+} Rewrite;
+
+// The corpus as a doubly linked list over tokens, so merges happen in place
+// and a merge site only ever touches its direct neighbours. weight holds how
+// many times the word around each position occurs, NULL meaning once.
+// The where lists of all pairs are carved out of lists. A list that grows or
+// whose pair merges goes to spare[c], c = floor(log2(capacity)), linked
+// through its first slot, and gets handed out again from there, so merging
+// stops calling malloc once the spares cover the churn.
+typedef struct {
+  Symbols tokens;
+  size_t *weight;
+  size_t *prev;
+  size_t *next;
+  Pairs pairs;
+  Heap heap;
+  Region lists;
+  size_t *spare[64];
+  Positions sorted;
+} Trainer;
+
+static size_t symbol_size(const Symbols *s) {
+  return s->wide ? sizeof(uint32_t) : sizeof(uint16_t);
+}
+
+static int sym_get(const Symbols *s, size_t i) {
+  if (s->wide)
+    return (int)((const uint32_t *)s->items)[i] - SYMBOL_BIAS;
+  return (int)((const uint16_t *)s->items)[i] - SYMBOL_BIAS;
+}
+
+static void sym_set(Symbols *s, size_t i, int id) {
+  if (s->wide)
+    ((uint32_t *)s->items)[i] = (uint32_t)(id + SYMBOL_BIAS);
+  else
+    ((uint16_t *)s->items)[i] = (uint16_t)(id + SYMBOL_BIAS);
+}
+
+static void symbols_reserve(Symbols *s, size_t n) {
+  if (n <= s->capacity)
+    return;
+  size_t capacity = s->capacity ? s->capacity : CHAOS_DA_INIT_CAP;
+  while (capacity < n)
+    capacity *= 2;
+  s->items = realloc(s->items, capacity * symbol_size(s));
+  CHAOS_ASSERT(s->items != NULL && "Buy more RAM lol");
+  s->capacity = capacity;
+}
+
+static void sym_append(Symbols *s, int id) {
+  symbols_reserve(s, s->count + 1);
+  sym_set(s, s->count++, id);
+}
+
+// Makes room for ids up to id, switching to uint32_t the first time one no
+// longer fits in a uint16_t.
+static void symbols_fit(Symbols *s, int id) {
+  if (s->wide || id <= NARROW_MAX)
+    return;
+
+  uint32_t *wide = malloc((s->capacity ? s->capacity : 1) * sizeof(*wide));
+  CHAOS_ASSERT(wide != NULL && "Buy more RAM lol");
+  const uint16_t *narrow = s->items;
+  for (size_t i = 0; i < s->count; ++i) {
+    wide[i] = narrow[i];
+  }
+  free(s->items);
+  s->items = wide;
+  s->wide = true;
+}
+
+static void symbols_free(Symbols *s) {
+  free(s->items);
+  *s = (Symbols){0};
+}
+
+static void sb_append_buf(String_Builder *sb, const void *data, size_t size) {
+  da_reserve(sb, sb->count + size);
+  memcpy(sb->items + sb->count, data, size);
+  sb->count += size;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Hands a progress message to the log callback, if there is one
+static void say(Config *cfg, const char *fmt, ...) {
+  if (!cfg->log)
+    return;
+  char message[1024];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(message, sizeof(message), fmt, args);
+  va_end(args);
+  cfg->log(cfg->log_user, message);
+}
+
+// One training iteration as it goes into the trace. Times are in seconds,
+// pairs/capacity describe the table the pair counts live in and lookups/
+// probes add up every table touched during the iteration.
+typedef struct {
+  int token;
+  int left;
+  int right;
+  size_t freq;
+  double count;
+  double select;
+  double merge;
+  size_t sites;
+  size_t pairs;
+  size_t capacity;
+  size_t lookups;
+  size_t probes;
+} Trace_Step;
+
+static bool tracing(Config *cfg) {
+  return STATS_ENABLED && cfg->trace.file != NULL;
+}
+
+// Clock reads for the trace, free when it is off
+static double trace_now(Config *cfg) {
+  return tracing(cfg) ? now() : 0;
+}
+
+// Moves the probe counters of tb into step
+static void trace_probes(Trace_Step *step, Pair_Table *tb) {
+#ifdef BPE_STATS
+  step->lookups += tb->lookups;
+  step->probes += tb->probes;
+  tb->lookups = 0;
+  tb->probes = 0;
+#else
+  (void)step;
+  (void)tb;
+#endif
+}
+
+static size_t trace_allocs(Trace *tr) {
+#ifdef BPE_STATS
+  size_t allocs = __atomic_load_n(&stats_allocs, __ATOMIC_RELAXED);
+  size_t delta = allocs - tr->allocs;
+  tr->allocs = allocs;
+  return delta;
+#else
+  (void)tr;
+  return 0;
+#endif
+}
+
+static void trace_fields(Trace *tr, Trace_Step *step) {
+  fprintf(tr->file,
+          "\"count_us\":%.3f,\"select_us\":%.3f,\"merge_us\":%.3f,"
+          "\"sites\":%zu,\"length\":%zu,\"pairs\":%zu,\"load\":%.4f,"
+          "\"lookups\":%zu,\"avg_probes\":%.3f,\"allocs\":%zu}\n",
+          step->count * 1e6, step->select * 1e6, step->merge * 1e6,
+          step->sites, tr->length, step->pairs,
+          step->capacity ? (double)step->pairs / step->capacity : 0.0,
+          step->lookups,
+          step->lookups ? (double)step->probes / step->lookups : 0.0,
+          trace_allocs(tr));
+}
+
+// The pair counting a trainer does before its first merge
+static void trace_init(Config *cfg, const char *trainer, size_t length,
+                       Trace_Step *step) {
+  if (!tracing(cfg))
+    return;
+  Trace *tr = &cfg->trace;
+  tr->iteration = 0;
+  tr->length = length;
+  tr->started = now() - step->count;
+  fprintf(tr->file, "{\"event\":\"init\",\"trainer\":\"%s\",", trainer);
+  trace_fields(tr, step);
+}
+
+static void trace_step(Config *cfg, Trace_Step *step, size_t length) {
+  if (!tracing(cfg))
+    return;
+  Trace *tr = &cfg->trace;
+  tr->length = length;
+  fprintf(tr->file,
+          "{\"event\":\"merge\",\"iteration\":%zu,\"token\":%d,"
+          "\"left\":%d,\"right\":%d,\"freq\":%zu,",
+          ++tr->iteration, step->token, step->left, step->right, step->freq);
+  trace_fields(tr, step);
+}
+
+static void trace_stop(Config *cfg, Stop stop) {
+  if (!tracing(cfg))
+    return;
+  Trace *tr = &cfg->trace;
+  fprintf(tr->file,
+          "{\"event\":\"stop\",\"reason\":\"%s\",\"iterations\":%zu,"
+          "\"length\":%zu,\"seconds\":%.6f}\n",
+          stop_names[stop], tr->iteration, tr->length, now() - tr->started);
+  fflush(tr->file);
+}
+
+// Checked before every merge, freq being the count of the best pair
+static Stop train_limit(Config *cfg, size_t freq, int next_token) {
+  if (freq <= 1)
+    return STOP_DONE;
+  if (cfg->vocab_size > 0 && next_token >= cfg->vocab_size)
+    return STOP_VOCAB_SIZE;
+  if (freq < cfg->min_frequency)
+    return STOP_MIN_FREQUENCY;
+  if (cfg->max_seconds > 0 && now() - cfg->started >= cfg->max_seconds)
+    return STOP_MAX_SECONDS;
+  return STOP_NONE;
+}
+
+static Pair *pairs_get(Pairs *ps, int left, int right) {
+  size_t *id = pair_table_at(&ps->index, pair_key(left, right));
+  if (*id == 0) {
+    da_append(ps, ((Pair){.left = left, .right = right, .heap_index = NO_POS}));
+    *id = ps->count;
+  }
+  return &ps->items[*id - 1];
+}
+
+// The where lists belong to the trainer's region
+static void pairs_free(Pairs *ps) {
+  free(ps->items);
+  pair_table_free(&ps->index);
+  *ps = (Pairs){0};
+}
+
+// Higher freq first, ties go to the lowest (left, right) so the merge order
+// never depends on hashing or insertion order.
+static bool pair_above(Pair *a, Pair *b) {
+  if (a->freq != b->freq)
+    return a->freq > b->freq;
+  if (a->left != b->left)
+    return a->left < b->left;
+  return a->right < b->right;
+}
+
+static void heap_place(Trainer *t, size_t slot, size_t id) {
+  t->heap.items[slot] = id;
+  t->pairs.items[id].heap_index = slot;
+}
+
+static void heap_sift_up(Trainer *t, size_t slot) {
+  size_t id = t->heap.items[slot];
+  Pair *p = &t->pairs.items[id];
+
+  while (slot > 0) {
+    size_t parent = (slot - 1) / 2;
+    size_t parent_id = t->heap.items[parent];
+    if (!pair_above(p, &t->pairs.items[parent_id]))
+      break;
+    heap_place(t, slot, parent_id);
+    slot = parent;
+  }
+  heap_place(t, slot, id);
+}
+
+static void heap_sift_down(Trainer *t, size_t slot) {
+  size_t id = t->heap.items[slot];
+  Pair *p = &t->pairs.items[id];
+
+  for (;;) {
+    size_t child = slot * 2 + 1;
+    if (child >= t->heap.count)
+      break;
+    if (child + 1 < t->heap.count &&
+        pair_above(&t->pairs.items[t->heap.items[child + 1]],
+                   &t->pairs.items[t->heap.items[child]]))
+      child++;
+
+    size_t child_id = t->heap.items[child];
+    if (!pair_above(&t->pairs.items[child_id], p))
+      break;
+    heap_place(t, slot, child_id);
+    slot = child;
+  }
+  heap_place(t, slot, id);
+}
+
+// Restores the heap after the freq of pair id changed in either direction,
+// inserting or dropping it when it crosses zero.
+static void heap_update(Trainer *t, size_t id) {
+  Pair *p = &t->pairs.items[id];
+  size_t slot = p->heap_index;
+
+  if (slot == NO_POS) {
+    if (p->freq == 0)
+      return;
+    da_append(&t->heap, id);
+    heap_sift_up(t, t->heap.count - 1);
+    return;
+  }
+
+  if (p->freq == 0) {
+    p->heap_index = NO_POS;
+    size_t last = t->heap.items[--t->heap.count];
+    if (slot == t->heap.count)
+      return;
+    heap_place(t, slot, last);
+    heap_sift_up(t, slot);
+    heap_sift_down(t, t->pairs.items[last].heap_index);
+    return;
+  }
+
+  heap_sift_up(t, slot);
+  heap_sift_down(t, p->heap_index);
+}
+
+static bool is_pair(int left, int right) {
+  return left >= 0 && right >= 0;
+}
+
+static size_t trainer_weight(Trainer *t, size_t pos) {
+  return t->weight ? t->weight[pos] : 1;
+}
+
+static size_t log2_floor(size_t n) {
+  size_t c = 0;
+  while (n >>= 1)
+    c++;
+  return c;
+}
+
+// A list with room for at least capacity positions
+static void where_alloc(Trainer *t, Positions *where, size_t capacity) {
+  size_t c = log2_floor(capacity);
+  if (((size_t)1 << c) < capacity)
+    c++;
+
+  if (t->spare[c]) {
+    where->items = t->spare[c];
+    t->spare[c] = *(size_t **)t->spare[c];
+  } else {
+    where->items = region_alloc(&t->lists, ((size_t)1 << c) * sizeof(size_t));
+  }
+  where->capacity = (size_t)1 << c;
+}
+
+static void where_release(Trainer *t, Positions *where) {
+  if (where->capacity > 0) {
+    size_t c = log2_floor(where->capacity);
+    *(size_t **)where->items = t->spare[c];
+    t->spare[c] = where->items;
+  }
+  *where = (Positions){0};
+}
+
+static void where_push(Trainer *t, Positions *where, size_t pos) {
+  if (where->count == where->capacity) {
+    Positions grown = {.count = where->count};
+    where_alloc(t, &grown, where->capacity ? where->capacity * 2 : 1);
+    if (where->count > 0)
+      memcpy(grown.items, where->items, where->count * sizeof(*where->items));
+    where_release(t, where);
+    *where = grown;
+  }
+  where->items[where->count++] = pos;
+}
+
+static void trainer_count(Trainer *t, size_t pos) {
+  size_t nxt = t->next[pos];
+  if (nxt == NO_POS)
+    return;
+  int left = sym_get(&t->tokens, pos);
+  int right = sym_get(&t->tokens, nxt);
+  if (!is_pair(left, right))
+    return;
+
+  Pair *p = pairs_get(&t->pairs, left, right);
+  p->freq += trainer_weight(t, pos);
+  where_push(t, &p->where, pos);
+  heap_update(t, p - t->pairs.items);
+}
+
+static void trainer_uncount(Trainer *t, size_t pos) {
+  size_t nxt = t->next[pos];
+  if (nxt == NO_POS)
+    return;
+  int left = sym_get(&t->tokens, pos);
+  int right = sym_get(&t->tokens, nxt);
+  if (!is_pair(left, right))
+    return;
+
+  Pair *p = pairs_get(&t->pairs, left, right);
+  CHAOS_ASSERT(p->freq >= trainer_weight(t, pos));
+  p->freq -= trainer_weight(t, pos);
+  heap_update(t, p - t->pairs.items);
+}
+
+// Runs fn once per element of jobs, an array of count elements of size bytes,
+// with the first one on the calling thread. Bookkeeping comes from r.
+static void run_parallel(void *(*fn)(void *), void *jobs, size_t size,
+                         size_t count, Region *r) {
+  pthread_t *threads = region_alloc(r, count * sizeof(*threads));
+  bool *started = region_calloc(r, count, sizeof(*started));
+
+  for (size_t k = 1; k < count; ++k) {
+    started[k] =
+        pthread_create(&threads[k], NULL, fn, (char *)jobs + k * size) == 0;
+  }
+  fn(jobs);
+  for (size_t k = 1; k < count; ++k) {
+    if (started[k])
+      pthread_join(threads[k], NULL);
+    else
+      fn((char *)jobs + k * size);
+  }
+}
+
+// Symbols of a corpus that is still all bytes (or sentinels) stay below this,
+// so their pairs fit a dense BYTE_SYMBOLS x BYTE_SYMBOLS table of counts
+#define BYTE_SYMBOLS (256 + SYMBOL_BIAS)
+
+// The scans over the raw symbol arrays, picked once per process from what
+// the CPU supports. find_pair returns the first k in [i, stop) where the
+// pair (a, b) sits at (k, k + 1), stop if there is none, so AAA runs still
+// merge left to right like the scalar loop they replace. max returns the
+// largest symbol of [i, stop) and byte_pairs adds 1 to counts[left *
+// BYTE_SYMBOLS + right] for every k in [i, stop), with symbols below
+// BYTE_SYMBOLS. BPE_SIMD=scalar|sse4.2|avx2 in the environment forces a level.
+typedef struct {
+  const char *name;
+  size_t (*find_pair16)(const uint16_t *items, size_t i, size_t stop,
+                        uint16_t a, uint16_t b);
+  size_t (*find_pair32)(const uint32_t *items, size_t i, size_t stop,
+                        uint32_t a, uint32_t b);
+  uint16_t (*max16)(const uint16_t *items, size_t i, size_t stop);
+  void (*byte_pairs)(const uint16_t *items, size_t i, size_t stop,
+                     uint64_t *counts);
+} Simd;
+
+static size_t find_pair16_scalar(const uint16_t *items, size_t i, size_t stop,
+                                 uint16_t a, uint16_t b) {
+  for (; i < stop; ++i) {
+    if (items[i] == a && items[i + 1] == b)
+      return i;
+  }
+  return stop;
+}
+
+static size_t find_pair32_scalar(const uint32_t *items, size_t i, size_t stop,
+                                 uint32_t a, uint32_t b) {
+  for (; i < stop; ++i) {
+    if (items[i] == a && items[i + 1] == b)
+      return i;
+  }
+  return stop;
+}
+
+static uint16_t max16_scalar(const uint16_t *items, size_t i, size_t stop) {
+  uint16_t max = 0;
+  for (; i < stop; ++i) {
+    if (items[i] > max)
+      max = items[i];
+  }
+  return max;
+}
+
+static void byte_pairs_scalar(const uint16_t *items, size_t i, size_t stop,
+                              uint64_t *counts) {
+  for (; i < stop; ++i) {
+    counts[items[i] * BYTE_SYMBOLS + items[i + 1]]++;
+  }
+}
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <immintrin.h>
+#define SIMD_X86 1
+
+// Compares the lanes at k and at k + 1 against a and b, the lowest set bit
+// of the byte mask is the first match. Reads up to items[k + lanes], which
+// the loop bounds keep below stop + 1.
+__attribute__((target("sse4.2"))) static size_t
+find_pair16_sse(const uint16_t *items, size_t i, size_t stop, uint16_t a,
+                uint16_t b) {
+  __m128i va = _mm_set1_epi16((short)a);
+  __m128i vb = _mm_set1_epi16((short)b);
+  for (; i + 8 <= stop; i += 8) {
+    __m128i l = _mm_loadu_si128((const __m128i *)(items + i));
+    __m128i r = _mm_loadu_si128((const __m128i *)(items + i + 1));
+    __m128i m = _mm_and_si128(_mm_cmpeq_epi16(l, va), _mm_cmpeq_epi16(r, vb));
+    unsigned mask = _mm_movemask_epi8(m);
+    if (mask)
+      return i + __builtin_ctz(mask) / 2;
+  }
+  return find_pair16_scalar(items, i, stop, a, b);
+}
+
+__attribute__((target("sse4.2"))) static size_t
+find_pair32_sse(const uint32_t *items, size_t i, size_t stop, uint32_t a,
+                uint32_t b) {
+  __m128i va = _mm_set1_epi32((int)a);
+  __m128i vb = _mm_set1_epi32((int)b);
+  for (; i + 4 <= stop; i += 4) {
+    __m128i l = _mm_loadu_si128((const __m128i *)(items + i));
+    __m128i r = _mm_loadu_si128((const __m128i *)(items + i + 1));
+    __m128i m = _mm_and_si128(_mm_cmpeq_epi32(l, va), _mm_cmpeq_epi32(r, vb));
+    unsigned mask = _mm_movemask_epi8(m);
+    if (mask)
+      return i + __builtin_ctz(mask) / 4;
+  }
+  return find_pair32_scalar(items, i, stop, a, b);
+}
+
+__attribute__((target("sse4.2"))) static uint16_t
+max16_sse(const uint16_t *items, size_t i, size_t stop) {
+  __m128i max = _mm_setzero_si128();
+  for (; i + 8 <= stop; i += 8) {
+    max = _mm_max_epu16(max, _mm_loadu_si128((const __m128i *)(items + i)));
+  }
+  uint16_t lanes[8];
+  _mm_storeu_si128((__m128i *)lanes, max);
+  uint16_t m = max16_scalar(items, i, stop);
+  for (size_t k = 0; k < 8; ++k) {
+    if (lanes[k] > m)
+      m = lanes[k];
+  }
+  return m;
+}
+
+// Builds the table indices of 8 pairs at a time, the increments themselves
+// stay scalar since x86 has no conflict free scatter add
+__attribute__((target("sse4.2"))) static void
+byte_pairs_sse(const uint16_t *items, size_t i, size_t stop,
+               uint64_t *counts) {
+  __m128i width = _mm_set1_epi32(BYTE_SYMBOLS);
+  uint32_t idx[8];
+  for (; i + 8 <= stop; i += 8) {
+    __m128i l = _mm_loadu_si128((const __m128i *)(items + i));
+    __m128i r = _mm_loadu_si128((const __m128i *)(items + i + 1));
+    __m128i lo = _mm_add_epi32(_mm_mullo_epi32(_mm_cvtepu16_epi32(l), width),
+                               _mm_cvtepu16_epi32(r));
+    __m128i hi = _mm_add_epi32(
+        _mm_mullo_epi32(_mm_cvtepu16_epi32(_mm_srli_si128(l, 8)), width),
+        _mm_cvtepu16_epi32(_mm_srli_si128(r, 8)));
+    _mm_storeu_si128((__m128i *)idx, lo);
+    _mm_storeu_si128((__m128i *)(idx + 4), hi);
+    for (size_t k = 0; k < 8; ++k) {
+      counts[idx[k]]++;
+    }
+  }
+  byte_pairs_scalar(items, i, stop, counts);
+}
+
+__attribute__((target("avx2"))) static size_t
+find_pair16_avx2(const uint16_t *items, size_t i, size_t stop, uint16_t a,
+                 uint16_t b) {
+  __m256i va = _mm256_set1_epi16((short)a);
+  __m256i vb = _mm256_set1_epi16((short)b);
+  for (; i + 16 <= stop; i += 16) {
+    __m256i l = _mm256_loadu_si256((const __m256i *)(items + i));
+    __m256i r = _mm256_loadu_si256((const __m256i *)(items + i + 1));
+    __m256i m =
+        _mm256_and_si256(_mm256_cmpeq_epi16(l, va), _mm256_cmpeq_epi16(r, vb));
+    unsigned mask = _mm256_movemask_epi8(m);
+    if (mask)
+      return i + __builtin_ctz(mask) / 2;
+  }
+  return find_pair16_sse(items, i, stop, a, b);
+}
+
+__attribute__((target("avx2"))) static size_t
+find_pair32_avx2(const uint32_t *items, size_t i, size_t stop, uint32_t a,
+                 uint32_t b) {
+  __m256i va = _mm256_set1_epi32((int)a);
+  __m256i vb = _mm256_set1_epi32((int)b);
+  for (; i + 8 <= stop; i += 8) {
+    __m256i l = _mm256_loadu_si256((const __m256i *)(items + i));
+    __m256i r = _mm256_loadu_si256((const __m256i *)(items + i + 1));
+    __m256i m =
+        _mm256_and_si256(_mm256_cmpeq_epi32(l, va), _mm256_cmpeq_epi32(r, vb));
+    unsigned mask = _mm256_movemask_epi8(m);
+    if (mask)
+      return i + __builtin_ctz(mask) / 4;
+  }
+  return find_pair32_sse(items, i, stop, a, b);
+}
+
+__attribute__((target("avx2"))) static uint16_t
+max16_avx2(const uint16_t *items, size_t i, size_t stop) {
+  __m256i max = _mm256_setzero_si256();
+  for (; i + 16 <= stop; i += 16) {
+    max = _mm256_max_epu16(max,
+                           _mm256_loadu_si256((const __m256i *)(items + i)));
+  }
+  uint16_t lanes[16];
+  _mm256_storeu_si256((__m256i *)lanes, max);
+  uint16_t m = max16_sse(items, i, stop);
+  for (size_t k = 0; k < 16; ++k) {
+    if (lanes[k] > m)
+      m = lanes[k];
+  }
+  return m;
+}
+
+__attribute__((target("avx2"))) static void
+byte_pairs_avx2(const uint16_t *items, size_t i, size_t stop,
+                uint64_t *counts) {
+  __m256i width = _mm256_set1_epi32(BYTE_SYMBOLS);
+  uint32_t idx[16];
+  for (; i + 16 <= stop; i += 16) {
+    __m256i l = _mm256_loadu_si256((const __m256i *)(items + i));
+    __m256i r = _mm256_loadu_si256((const __m256i *)(items + i + 1));
+    __m256i lo = _mm256_add_epi32(
+        _mm256_mullo_epi32(
+            _mm256_cvtepu16_epi32(_mm256_castsi256_si128(l)), width),
+        _mm256_cvtepu16_epi32(_mm256_castsi256_si128(r)));
+    __m256i hi = _mm256_add_epi32(
+        _mm256_mullo_epi32(
+            _mm256_cvtepu16_epi32(_mm256_extracti128_si256(l, 1)), width),
+        _mm256_cvtepu16_epi32(_mm256_extracti128_si256(r, 1)));
+    _mm256_storeu_si256((__m256i *)idx, lo);
+    _mm256_storeu_si256((__m256i *)(idx + 8), hi);
+    for (size_t k = 0; k < 16; ++k) {
+      counts[idx[k]]++;
+    }
+  }
+  byte_pairs_scalar(items, i, stop, counts);
+}
+#endif
+
+static const Simd simd_scalar = {
+    "scalar", find_pair16_scalar, find_pair32_scalar, max16_scalar,
+    byte_pairs_scalar,
+};
+
+#ifdef SIMD_X86
+static const Simd simd_sse = {
+    "sse4.2", find_pair16_sse, find_pair32_sse, max16_sse, byte_pairs_sse,
+};
+static const Simd simd_avx2 = {
+    "avx2", find_pair16_avx2, find_pair32_avx2, max16_avx2, byte_pairs_avx2,
+};
+#endif
+
+static const Simd *simd = &simd_scalar;
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+static void simd_pick(void) {
+  const char *force = getenv("BPE_SIMD");
+#ifdef SIMD_X86
+  __builtin_cpu_init();
+  bool avx2 = __builtin_cpu_supports("avx2");
+  bool sse = __builtin_cpu_supports("sse4.2");
+  if (force && strcmp(force, "avx2") == 0 && !avx2)
+    force = NULL;
+  if (force && strcmp(force, "sse4.2") == 0 && !sse)
+    force = NULL;
+  if (force && strcmp(force, "scalar") == 0)
+    simd = &simd_scalar;
+  else if (force && strcmp(force, "sse4.2") == 0)
+    simd = &simd_sse;
+  else if (avx2)
+    simd = &simd_avx2;
+  else if (sse)
+    simd = &simd_sse;
+#else
+  (void)force;
+#endif
+}
+
+static const Simd *simd_kernels(void) {
+  pthread_once(&simd_once, simd_pick);
+  return simd;
+}
+
+// Walks the pairs starting in the shard as (i, left, right) over the raw
+// items of type T, skipping the ones next to a sentinel
+#define SHARD_FOREACH(T, sh, body)                                            \
+  do {                                                                        \
+    const T *items = (sh)->tokens->items;                                     \
+    size_t count = (sh)->tokens->count;                                       \
+    for (size_t i = (sh)->begin; i < (sh)->end && i + 1 < count; ++i) {       \
+      int left = (int)items[i] - SYMBOL_BIAS;                                 \
+      int right = (int)items[i + 1] - SYMBOL_BIAS;                            \
+      if (is_pair(left, right))                                               \
+        body                                                                  \
+    }                                                                         \
+  } while (0)
+
+// A shard of nothing but bytes and sentinels is counted into a dense table,
+// no hashing involved
+static bool count_bytes(Shard *sh, Region *r) {
+  const Symbols *tokens = sh->tokens;
+  size_t stop = sh->end < tokens->count ? sh->end : tokens->count - 1;
+  if (tokens->wide || sh->begin >= stop)
+    return false;
+
+  const Simd *k = simd_kernels();
+  const uint16_t *items = tokens->items;
+  if (k->max16(items, sh->begin, stop + 1) >= BYTE_SYMBOLS)
+    return false;
+
+  sh->dense = region_calloc(r, BYTE_SYMBOLS * BYTE_SYMBOLS, sizeof(uint64_t));
+  k->byte_pairs(items, sh->begin, stop, sh->dense);
+  return true;
+}
+
+// Walks the real pairs of a dense table as (idx, left, right), skipping the
+// rows and columns of the sentinels
+#define DENSE_FOREACH(body)                                                   \
+  do {                                                                        \
+    for (int left = 0; left < 256; ++left) {                                  \
+      size_t row = (size_t)(left + SYMBOL_BIAS) * BYTE_SYMBOLS + SYMBOL_BIAS; \
+      for (int right = 0; right < 256; ++right) {                             \
+        size_t idx = row + right;                                             \
+        body                                                                  \
+      }                                                                       \
+    }                                                                         \
+  } while (0)
+
+// When every shard was counted densely, adds their counts up into one table
+// of r, the per thread copies reduced in one pass. Otherwise moves the dense
+// counts into the pair tables of their shards, so all of them look alike to
+// the caller, and returns NULL.
+static size_t *shards_dense(Shard *shards, size_t n, Region *r) {
+  bool all = true;
+  for (size_t k = 0; k < n; ++k) {
+    all = all && shards[k].dense != NULL;
+  }
+
+  if (!all) {
+    for (size_t k = 0; k < n; ++k) {
+      const uint64_t *dense = shards[k].dense;
+      if (dense)
+        DENSE_FOREACH({
+          if (dense[idx])
+            *pair_table_at(&shards[k].pairs, pair_key(left, right)) +=
+                dense[idx];
+        });
+    }
+    return NULL;
+  }
+
+  size_t *total = region_calloc(r, BYTE_SYMBOLS * BYTE_SYMBOLS, sizeof(*total));
+  for (size_t k = 0; k < n; ++k) {
+    const uint64_t *dense = shards[k].dense;
+    for (size_t idx = 0; idx < BYTE_SYMBOLS * BYTE_SYMBOLS; ++idx) {
+      total[idx] += dense[idx];
+    }
+  }
+  return total;
+}
+
+static void *count_shard(void *arg) {
+  Shard *sh = arg;
+  if (count_bytes(sh, sh->pairs.region))
+    return NULL;
+#define COUNT_PAIR { *pair_table_at(&sh->pairs, pair_key(left, right)) += 1; }
+  if (sh->tokens->wide)
+    SHARD_FOREACH(uint32_t, sh, COUNT_PAIR);
+  else
+    SHARD_FOREACH(uint16_t, sh, COUNT_PAIR);
+#undef COUNT_PAIR
+  return NULL;
+}
+
+// The dense twin of index_shard, cursors is indexed like dense
+static void *index_bytes(void *arg) {
+  Shard *sh = arg;
+  const uint16_t *items = sh->tokens->items;
+  size_t stop = sh->end < sh->tokens->count ? sh->end : sh->tokens->count - 1;
+  for (size_t i = sh->begin; i < stop; ++i) {
+    if (items[i] >= SYMBOL_BIAS && items[i + 1] >= SYMBOL_BIAS)
+      *sh->cursors[items[i] * BYTE_SYMBOLS + items[i + 1]]++ = i;
+  }
+  return NULL;
+}
+
+// Needs the pairs of the shard to map each key to its cursor, a pointer into
+// the where list of that pair where its next position goes.
+static void *index_shard(void *arg) {
+  Shard *sh = arg;
+#define INDEX_PAIR                                                            \
+  {                                                                           \
+    size_t *c = pair_table_find(&sh->pairs, pair_key(left, right));           \
+    *sh->cursors[*c]++ = i;                                                   \
+  }
+  if (sh->tokens->wide)
+    SHARD_FOREACH(uint32_t, sh, INDEX_PAIR);
+  else
+    SHARD_FOREACH(uint16_t, sh, INDEX_PAIR);
+#undef INDEX_PAIR
+  return NULL;
+}
+
+// Counts every adjacent pair of tokens on up to threads threads, each into
+// its own table. The caller merges the shards and frees them.
+static size_t shard_count_for(size_t count, size_t threads) {
+  size_t n = count / MIN_SHARD_TOKENS;
+  if (n > threads)
+    n = threads;
+  return n ? n : 1;
+}
+
+// Shards live in r and shard k grows its table in tables[k], one of at
+// least threads regions, since regions are not safe to share across threads.
+// They go away with the regions.
+static Shard *count_pairs(const Symbols *tokens, size_t threads, Region *r,
+                          Region *tables, size_t *shard_count) {
+  size_t count = tokens->count;
+  size_t n = shard_count_for(count, threads);
+
+  Shard *shards = region_calloc(r, n, sizeof(*shards));
+  for (size_t k = 0; k < n; ++k) {
+    shards[k].tokens = tokens;
+    shards[k].pairs.region = &tables[k];
+    shards[k].begin = count * k / n;
+    shards[k].end = count * (k + 1) / n;
+  }
+
+  run_parallel(count_shard, shards, sizeof(*shards), n, r);
+  *shard_count = n;
+  return shards;
+}
+
+// Whether the pair at (i, i + 1) is merged by a left to right scan. Only runs
+// of the same token, like AAA, depend on what came before them.
+static bool merges_at(const Symbols *tokens, size_t i, int A, int B) {
+  if (i + 1 >= tokens->count || sym_get(tokens, i) != A ||
+      sym_get(tokens, i + 1) != B)
+    return false;
+  if (A != B)
+    return true;
+
+  size_t run = i;
+  while (run > 0 && sym_get(tokens, run - 1) == A)
+    run--;
+  return (i - run) % 2 == 0;
+}
+
+// Jumps from one site to the next with find, sliding the tokens in between
+// down in one go. The last token of the shard pairs with the next shard's
+// first, whether that merges was worked out up front.
+#define REWRITE(T, find)                                                      \
+  do {                                                                        \
+    T *items = rw->tokens->items;                                             \
+    T left = (T)(rw->left + SYMBOL_BIAS);                                     \
+    T right = (T)(rw->right + SYMBOL_BIAS);                                   \
+    T token = (T)(rw->token + SYMBOL_BIAS);                                   \
+    while (i < rw->end) {                                                     \
+      size_t site = find(items, i, rw->end - 1, left, right);                 \
+      if (w != i)                                                             \
+        memmove(items + w, items + i, (site - i) * sizeof(T));                \
+      w += site - i;                                                          \
+      i = site;                                                               \
+      if (i + 1 < rw->end || rw->last_merges) {                               \
+        items[w++] = token;                                                   \
+        i += 2;                                                               \
+      } else {                                                                \
+        items[w++] = items[i++];                                              \
+      }                                                                       \
+    }                                                                         \
+  } while (0)
+
+static void *rewrite_shard(void *arg) {
+  Rewrite *rw = arg;
+  const Simd *k = simd_kernels();
+  size_t w = rw->begin;
+  size_t i = rw->begin + rw->first_taken;
+
+  if (rw->tokens->wide)
+    REWRITE(uint32_t, k->find_pair32);
+  else
+    REWRITE(uint16_t, k->find_pair16);
+
+  rw->written = w - rw->begin;
+  return NULL;
+}
+#undef REWRITE
+
+// Replaces every (A, B) of tokens by token in place. Each slice compacts
+// itself on its own thread, then the slices are slid down next to each other.
+static void apply_merge(Symbols *tokens, int A, int B, int token,
+                        size_t threads, Region *r) {
+  symbols_fit(tokens, token);
+  size_t n = shard_count_for(tokens->count, threads);
+  Rewrite *rws = region_calloc(r, n, sizeof(*rws));
+
+  for (size_t k = 0; k < n; ++k) {
+    rws[k] = (Rewrite){
+        .tokens = tokens,
+        .begin = tokens->count * k / n,
+        .end = tokens->count * (k + 1) / n,
+        .left = A,
+        .right = B,
+        .token = token,
+    };
+  }
+  for (size_t k = 0; k < n; ++k) {
+    size_t last = rws[k].end - 1;
+    if (rws[k].end > rws[k].begin)
+      rws[k].last_merges = merges_at(tokens, last, A, B);
+    if (k + 1 < n)
+      rws[k + 1].first_taken = rws[k].last_merges;
+  }
+
+  run_parallel(rewrite_shard, rws, sizeof(*rws), n, r);
+
+  size_t size = symbol_size(tokens);
+  char *items = tokens->items;
+  size_t count = rws[0].written;
+  for (size_t k = 1; k < n; ++k) {
+    memmove(items + count * size, items + rws[k].begin * size,
+            rws[k].written * size);
+    count += rws[k].written;
+  }
+  tokens->count = count;
+}
+
+// Turns the shard tables into the trainer's pairs. Each shard's count of a
+// pair becomes the offset its positions start at in the where list of that
+// pair, so the lists are filled in parallel and still come out sorted.
+static void trainer_seed(Trainer *t, Shard *shards, size_t shard_count,
+                         Region *scratch) {
+  for (size_t k = 0; k < shard_count; ++k) {
+    Pair_Table *local = &shards[k].pairs;
+    for (size_t s = 0; s < local->capacity; ++s) {
+      Pair_KV *kv = &local->items[s];
+      if (kv->key == CHAOS_PAIR_EMPTY)
+        continue;
+      Pair *p = pairs_get(&t->pairs, pair_left(kv->key), pair_right(kv->key));
+      size_t freq = kv->value;
+      kv->value = p->freq;
+      p->freq += freq;
+    }
+  }
+
+  // Sized exactly, they only round up to a power of two once they grow
+  for (size_t id = 0; id < t->pairs.count; ++id) {
+    Positions *where = &t->pairs.items[id].where;
+    where->count = where->capacity = t->pairs.items[id].freq;
+    where->items = region_alloc(&t->lists, where->count * sizeof(size_t));
+  }
+
+  for (size_t k = 0; k < shard_count; ++k) {
+    Pair_Table *local = &shards[k].pairs;
+    shards[k].cursors =
+        region_alloc(scratch, local->count * sizeof(*shards[k].cursors));
+
+    size_t c = 0;
+    for (size_t s = 0; s < local->capacity; ++s) {
+      Pair_KV *kv = &local->items[s];
+      if (kv->key == CHAOS_PAIR_EMPTY)
+        continue;
+      Pair *p = pairs_get(&t->pairs, pair_left(kv->key), pair_right(kv->key));
+      shards[k].cursors[c] = p->where.items + kv->value;
+      kv->value = c++;
+    }
+  }
+}
+
+// Same for a corpus of bytes, straight from the summed dense counts. The
+// cursors of each shard are a dense table too, so indexing never hashes.
+static void trainer_seed_bytes(Trainer *t, Shard *shards, size_t shard_count,
+                               const size_t *total, Region *scratch) {
+  Pair **pairs = region_calloc(scratch, BYTE_SYMBOLS * BYTE_SYMBOLS,
+                               sizeof(*pairs));
+  DENSE_FOREACH({
+    if (total[idx] == 0)
+      continue;
+    Pair *p = pairs_get(&t->pairs, left, right);
+    p->freq = total[idx];
+    p->where.count = p->where.capacity = total[idx];
+    p->where.items = region_alloc(&t->lists, total[idx] * sizeof(size_t));
+  });
+  // pairs only stops moving once every pair is in
+  DENSE_FOREACH({
+    if (total[idx] != 0)
+      pairs[idx] = pairs_get(&t->pairs, left, right);
+  });
+
+  size_t *offset = region_calloc(scratch, BYTE_SYMBOLS * BYTE_SYMBOLS,
+                                 sizeof(*offset));
+  for (size_t k = 0; k < shard_count; ++k) {
+    shards[k].cursors = region_calloc(scratch, BYTE_SYMBOLS * BYTE_SYMBOLS,
+                                      sizeof(*shards[k].cursors));
+    const uint64_t *dense = shards[k].dense;
+    DENSE_FOREACH({
+      if (dense[idx] == 0)
+        continue;
+      shards[k].cursors[idx] = pairs[idx]->where.items + offset[idx];
+      offset[idx] += dense[idx];
+    });
+  }
+}
+
+// Takes ownership of tokens and weight
+static void trainer_init(Trainer *t, Symbols *tokens, size_t *weight,
+                         size_t threads) {
+  size_t n = tokens->count;
+
+  t->tokens = *tokens;
+  t->weight = weight;
+  *tokens = (Symbols){0};
+  t->prev = malloc(n * sizeof(*t->prev));
+  t->next = malloc(n * sizeof(*t->next));
+  CHAOS_ASSERT((n == 0 || (t->prev && t->next)) && "Buy more RAM lol");
+
+  for (size_t i = 0; i < n; ++i) {
+    t->prev[i] = i == 0 ? NO_POS : i - 1;
+    t->next[i] = i + 1 == n ? NO_POS : i + 1;
+  }
+  // Count everything first and heapify once, instead of sifting on every
+  // single occurrence
+  Region scratch = {0};
+  Region *tables = region_calloc(&scratch, threads, sizeof(*tables));
+  size_t shard_count = 0;
+  Shard *shards =
+      count_pairs(&t->tokens, threads, &scratch, tables, &shard_count);
+
+  size_t *total = shards_dense(shards, shard_count, &scratch);
+  if (total) {
+    trainer_seed_bytes(t, shards, shard_count, total, &scratch);
+    run_parallel(index_bytes, shards, sizeof(*shards), shard_count, &scratch);
+  } else {
+    trainer_seed(t, shards, shard_count, &scratch);
+    run_parallel(index_shard, shards, sizeof(*shards), shard_count, &scratch);
+  }
+  for (size_t k = 0; k < threads; ++k) {
+    region_free(&tables[k]);
+  }
+  region_free(&scratch);
+
+  // So far freq only counted positions
+  if (t->weight) {
+    for (size_t id = 0; id < t->pairs.count; ++id) {
+      Pair *p = &t->pairs.items[id];
+      p->freq = 0;
+      for (size_t w = 0; w < p->where.count; ++w) {
+        p->freq += t->weight[p->where.items[w]];
+      }
+    }
+  }
+
+  da_reserve(&t->heap, t->pairs.count);
+  for (size_t id = 0; id < t->pairs.count; ++id) {
+    heap_place(t, t->heap.count++, id);
+  }
+  for (size_t slot = t->heap.count / 2; slot-- > 0;) {
+    heap_sift_down(t, slot);
+  }
+}
+
+static int compare_positions(const void *a, const void *b) {
+  size_t x = *(const size_t *)a;
+  size_t y = *(const size_t *)b;
+  return (x > y) - (x < y);
+}
+
+// A where list is a few increasing runs back to back, the initial scan plus
+// the sites of each later merge in order, so a natural merge sort of the runs
+// beats qsort and only needs scratch, which is kept around between calls.
+static void sort_positions(size_t *a, size_t n, Positions *scratch) {
+  if (n < 2)
+    return;
+  da_reserve(scratch, n);
+
+  size_t *src = a;
+  size_t *dst = scratch->items;
+  for (;;) {
+    size_t lo = 0;
+    while (lo < n) {
+      size_t mid = lo + 1;
+      while (mid < n && src[mid - 1] <= src[mid])
+        mid++;
+      if (lo == 0 && mid == n)
+        break;
+      size_t hi = mid < n ? mid + 1 : n;
+      while (hi < n && src[hi - 1] <= src[hi])
+        hi++;
+
+      size_t i = lo, j = mid, k = lo;
+      while (i < mid && j < hi)
+        dst[k++] = src[j] < src[i] ? src[j++] : src[i++];
+      while (i < mid)
+        dst[k++] = src[i++];
+      while (j < hi)
+        dst[k++] = src[j++];
+      lo = hi;
+    }
+    if (lo == 0)
+      break;
+
+    size_t *tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+
+  if (src != a)
+    memcpy(a, src, n * sizeof(*a));
+}
+
+// Rewrites every live occurrence of p into token, left to right so runs like
+// AAA merge exactly like a full rescan would, and patches the counts of the
+// neighbouring pairs at each site.
+// Returns how many sites merged, stale entries of the where list skipped
+static size_t trainer_merge(Trainer *t, Pair *p, int token) {
+  int A = p->left;
+  int B = p->right;
+  Symbols *items = &t->tokens;
+  symbols_fit(items, token);
+
+  Positions where = p->where;
+  p->where = (Positions){0};
+  sort_positions(where.items, where.count, &t->sorted);
+
+  size_t sites = 0;
+  for (size_t w = 0; w < where.count; ++w) {
+    size_t i = where.items[w];
+    if (sym_get(items, i) != A)
+      continue;
+    size_t j = t->next[i];
+    if (j == NO_POS || sym_get(items, j) != B)
+      continue;
+
+    size_t h = t->prev[i];
+    size_t k = t->next[j];
+
+    if (h != NO_POS)
+      trainer_uncount(t, h);
+    trainer_uncount(t, i);
+    trainer_uncount(t, j);
+
+    sym_set(items, i, token);
+    sym_set(items, j, DEAD_TOKEN);
+    t->next[i] = k;
+    if (k != NO_POS)
+      t->prev[k] = i;
+
+    if (h != NO_POS)
+      trainer_count(t, h);
+    trainer_count(t, i);
+    sites++;
+  }
+
+  where_release(t, &where);
+  return sites;
+}
+
+static Pair *trainer_best(Trainer *t) {
+  if (t->heap.count == 0)
+    return NULL;
+  return &t->pairs.items[t->heap.items[0]];
+}
+
+// The list only ever links forward, so live tokens are slid down in place.
+static void trainer_finish(Trainer *t, Symbols *tokens) {
+  size_t count = 0;
+  for (size_t i = t->tokens.count ? 0 : NO_POS; i != NO_POS; i = t->next[i]) {
+    sym_set(&t->tokens, count++, sym_get(&t->tokens, i));
+  }
+  t->tokens.count = count;
+  *tokens = t->tokens;
+
+  free(t->weight);
+  free(t->prev);
+  free(t->next);
+  free(t->heap.items);
+  pairs_free(&t->pairs);
+  region_free(&t->lists);
+  free(t->sorted.items);
+}
+
+// The token stream is tokens in order or, with next, the list starting at 0
+static bool checkpoint_save(Config *cfg, Merges *merges, Symbols *tokens,
+                            const size_t *next) {
+  Checkpoint *ck = &cfg->checkpoint;
+  String_Builder body = {0};
+  for (size_t m = 0; m < merges->count; ++m) {
+    Model_Merge mm = {merges->items[m].left, merges->items[m].right};
+    sb_append_buf(&body, &mm, sizeof(mm));
+  }
+
+  size_t token_count = 0;
+  for (size_t i = tokens->count ? 0 : NO_POS; i != NO_POS;) {
+    int32_t id = sym_get(tokens, i);
+    sb_append_buf(&body, &id, sizeof(id));
+    token_count++;
+    if (next)
+      i = next[i];
+    else
+      i = i + 1 < tokens->count ? i + 1 : NO_POS;
+  }
+
+  Checkpoint_Header h = {
+      .version = CHECKPOINT_VERSION,
+      .merge_count = merges->count,
+      .token_count = token_count,
+      .fingerprint = ck->fingerprint,
+      .checksum = chaos_hash_bytes(body.items, body.count),
+  };
+  memcpy(h.magic, CHECKPOINT_MAGIC, sizeof(h.magic));
+
+  String_Builder out = {0};
+  sb_append_buf(&out, &h, sizeof(h));
+  sb_append_buf(&out, body.items, body.count);
+
+  // Never leave a torn checkpoint behind in place of a good one
+  char *tmp = temp_sprintf("%s.tmp", ck->path);
+  bool ok = write_file(tmp, &out);
+  if (ok && rename(tmp, ck->path) != 0) {
+    fprintf(stderr, "Cannot rename <%s> to <%s>\n", tmp, ck->path);
+    ok = false;
+  }
+  if (ok)
+    say(cfg, "Checkpoint: %zu merges in %s", merges->count, ck->path);
+
+  ck->saved = merges->count;
+  ck->time = now();
+  free(out.items);
+  free(body.items);
+  return ok;
+}
+
+// Called after every merge, a failed save is reported and training goes on
+static void checkpoint_tick(Config *cfg, Merges *merges, Symbols *tokens,
+                            const size_t *next) {
+  Checkpoint *ck = &cfg->checkpoint;
+  if (!ck->path)
+    return;
+  if ((ck->every && merges->count - ck->saved >= ck->every) ||
+      (ck->seconds > 0 && now() - ck->time >= ck->seconds))
+    checkpoint_save(cfg, merges, tokens, next);
+}
+
+// Once training stops at a limit the state is saved, so raising the limit
+// and resuming carries on from there.
+static void checkpoint_stop(Config *cfg, Stop stop, Merges *merges,
+                            Symbols *tokens) {
+  if (cfg->checkpoint.path && stop != STOP_DONE && stop != STOP_FAILED)
+    checkpoint_save(cfg, merges, tokens, NULL);
+}
+
+// The same rules as a model's merges, and the tokens may only be word breaks
+// or ids the merges have made, so nothing the trainer indexes by id can be
+// out of range
+static bool checkpoint_valid(const Checkpoint_Header *h,
+                             const Model_Merge *merges, const int32_t *ids) {
+  if (h->merge_count > INT32_MAX - 256)
+    return false;
+  for (uint32_t i = 0; i < h->merge_count; ++i) {
+    int64_t limit = 256 + (int64_t)i;
+    if (merges[i].left < 0 || merges[i].left >= limit || merges[i].right < 0 ||
+        merges[i].right >= limit)
+      return false;
+  }
+  int64_t next = 256 + (int64_t)h->merge_count;
+  for (uint64_t i = 0; i < h->token_count; ++i) {
+    if (ids[i] != WORD_BREAK && (ids[i] < 0 || ids[i] >= next))
+      return false;
+  }
+  return true;
+}
+
+static bool checkpoint_load(char *path, uint64_t fingerprint, Symbols *tokens,
+                            Merges *merges, int *next_token) {
+  String_Builder sb = {0};
+  if (!read_file(path, &sb))
+    return false;
+
+  const Checkpoint_Header *h = (const Checkpoint_Header *)sb.items;
+  const char *body = sb.items + sizeof(*h);
+  size_t body_size = sb.count - sizeof(*h);
+  const Model_Merge *mm = (const Model_Merge *)body;
+  bool ok = sb.count >= sizeof(*h) &&
+            memcmp(h->magic, CHECKPOINT_MAGIC, sizeof(h->magic)) == 0 &&
+            h->version == CHECKPOINT_VERSION &&
+            h->token_count <= body_size / sizeof(int32_t) &&
+            body_size == h->merge_count * sizeof(Model_Merge) +
+                             h->token_count * sizeof(int32_t) &&
+            chaos_hash_bytes(body, body_size) == h->checksum &&
+            checkpoint_valid(h, mm, (const int32_t *)(mm + h->merge_count));
+  if (!ok) {
+    fprintf(stderr, "Corrupt or incompatible checkpoint: <%s>\n", path);
+    free(sb.items);
+    return false;
+  }
+  if (h->fingerprint != fingerprint) {
+    fprintf(stderr, "Checkpoint <%s> comes from another input or mode\n",
+            path);
+    free(sb.items);
+    return false;
+  }
+
+  merges->count = 0;
+  for (uint32_t m = 0; m < h->merge_count; ++m) {
+    da_append(merges, ((Merge){
+                          .left = mm[m].left,
+                          .right = mm[m].right,
+                          .token = 256 + m,
+                      }));
+  }
+  *next_token = 256 + h->merge_count;
+
+  const int32_t *ids = (const int32_t *)(mm + h->merge_count);
+  tokens->count = 0;
+  symbols_fit(tokens, *next_token - 1);
+  symbols_reserve(tokens, h->token_count);
+  for (uint64_t i = 0; i < h->token_count; ++i) {
+    sym_set(tokens, tokens->count++, ids[i]);
+  }
+
+  free(sb.items);
+  return true;
+}
+
+// Fingerprints the stream training is about to start from and, when
+// resuming, swaps it and merges for the checkpointed ones. freqs are the
+// word counts of --words streams, they shape the run as much as the tokens.
+static bool checkpoint_begin(Config *cfg, Symbols *tokens,
+                             const Positions *freqs, Merges *merges,
+                             int *next_token) {
+  Checkpoint *ck = &cfg->checkpoint;
+  uint64_t h = chaos_hash_bytes(tokens->items, tokens->count * symbol_size(tokens));
+  h = chaos_hash_u64(h ^ tokens->count);
+  if (freqs)
+    h = chaos_hash_u64(h ^ chaos_hash_bytes(freqs->items, freqs->count *
+                                                          sizeof(*freqs->items)));
+  ck->fingerprint = h;
+  ck->time = now();
+
+  if (ck->resume) {
+    if (!checkpoint_load(ck->resume, h, tokens, merges, next_token))
+      return false;
+    say(cfg, "Resumed from %s at %zu merges", ck->resume, merges->count);
+  }
+  ck->saved = merges->count;
+  return true;
+}
+
+static Stop train_incremental(Symbols *tokens, size_t *weight, Merges *merges,
+                              int *next_token, Config *cfg) {
+  Trainer t = {0};
+  size_t length = tokens->count;
+  double start = trace_now(cfg);
+  trainer_init(&t, tokens, weight, cfg->threads);
+  if (tracing(cfg)) {
+    Trace_Step init = {
+        .count = trace_now(cfg) - start,
+        .pairs = t.pairs.index.count,
+        .capacity = t.pairs.index.capacity,
+    };
+    trace_probes(&init, &t.pairs.index);
+    trace_init(cfg, "incremental", length, &init);
+  }
+
+  // Pair counts are patched while merging, so that is where counting time
+  // shows up in the trace
+  Stop stop = STOP_NONE;
+  while (stop == STOP_NONE) {
+    double select = trace_now(cfg);
+    Pair *best = trainer_best(&t);
+    stop = train_limit(cfg, best ? best->freq : 0, *next_token);
+    if (stop != STOP_NONE)
+      break;
+
+    da_append(merges, ((Merge){
+                          .left = best->left,
+                          .right = best->right,
+                          .token = *next_token,
+                      }));
+
+    Trace_Step step = {
+        .token = *next_token,
+        .left = best->left,
+        .right = best->right,
+        .freq = best->freq,
+    };
+    double merge = trace_now(cfg);
+    step.sites = trainer_merge(&t, best, *next_token);
+    if (tracing(cfg)) {
+      step.select = merge - select;
+      step.merge = trace_now(cfg) - merge;
+      step.pairs = t.pairs.index.count;
+      step.capacity = t.pairs.index.capacity;
+      trace_probes(&step, &t.pairs.index);
+      length -= step.sites;
+      trace_step(cfg, &step, length);
+    }
+    (*next_token)++;
+    checkpoint_tick(cfg, merges, &t.tokens, t.next);
+  }
+
+  trainer_finish(&t, tokens);
+  trace_stop(cfg, stop);
+  checkpoint_stop(cfg, stop, merges, tokens);
+  return stop;
+}
+
+// Recounts every pair of the corpus on each merge. Far too slow for real
+// inputs, kept as the reference train_incremental is checked against.
+static Stop train_reference(Symbols *tokens, Merges *merges, int *next_token,
+                            Config *cfg) {
+  // Everything one round needs comes from here and is dropped in one go
+  Region round = {0};
+  Region *tables = calloc(cfg->threads, sizeof(*tables));
+  CHAOS_ASSERT(tables != NULL && "Buy more RAM lol");
+  if (tracing(cfg)) {
+    Trace_Step init = {0};
+    trace_init(cfg, "reference", tokens->count, &init);
+  }
+
+  Stop stop = STOP_NONE;
+  while (stop == STOP_NONE) {
+    region_reset(&round);
+    for (size_t k = 0; k < cfg->threads; ++k) {
+      region_reset(&tables[k]);
+    }
+    double count = trace_now(cfg);
+    size_t shard_count = 0;
+    Shard *shards =
+        count_pairs(tokens, cfg->threads, &round, tables, &shard_count);
+
+    Pair_Table *tb = &shards[0].pairs;
+    size_t *total = shards_dense(shards, shard_count, &round);
+    if (total)
+      DENSE_FOREACH({
+        if (total[idx])
+          *pair_table_at(tb, pair_key(left, right)) = total[idx];
+      });
+    for (size_t k = 1; !total && k < shard_count; ++k) {
+      Pair_Table *local = &shards[k].pairs;
+      for (size_t s = 0; s < local->capacity; ++s) {
+        if (local->items[s].key != CHAOS_PAIR_EMPTY)
+          *pair_table_at(tb, local->items[s].key) += local->items[s].value;
+      }
+    }
+
+    // Packed keys order the same way the pairs do, so ties go to the lowest
+    // (left, right) just like in train_incremental.
+    double select = trace_now(cfg);
+    Pair_KV *best = NULL;
+    for (size_t i = 0; i < tb->capacity; ++i) {
+      Pair_KV *kv = &tb->items[i];
+      if (kv->key == CHAOS_PAIR_EMPTY)
+        continue;
+      if (!best || kv->value > best->value ||
+          (kv->value == best->value && kv->key < best->key)) {
+        best = kv;
+      }
+    }
+
+    stop = train_limit(cfg, best ? best->value : 0, *next_token);
+    if (stop != STOP_NONE)
+      break;
+
+    int A = pair_left(best->key);
+    int B = pair_right(best->key);
+    Trace_Step step = {
+        .token = *next_token,
+        .left = A,
+        .right = B,
+        .freq = best->value,
+        .pairs = tb->count,
+        .capacity = tb->capacity,
+    };
+
+    double merge = trace_now(cfg);
+    size_t length = tokens->count;
+    apply_merge(tokens, A, B, *next_token, cfg->threads, &round);
+    if (tracing(cfg)) {
+      step.count = select - count;
+      step.select = merge - select;
+      step.merge = trace_now(cfg) - merge;
+      step.sites = length - tokens->count;
+      for (size_t k = 0; k < shard_count; ++k) {
+        trace_probes(&step, &shards[k].pairs);
+      }
+      trace_step(cfg, &step, tokens->count);
+    }
+
+    da_append(merges, ((Merge){
+                          .left = A,
+                          .right = B,
+                          .token = *next_token,
+                      }));
+
+    (*next_token)++;
+    checkpoint_tick(cfg, merges, tokens, NULL);
+  }
+
+  region_free(&round);
+  for (size_t k = 0; k < cfg->threads; ++k) {
+    region_free(&tables[k]);
+  }
+  free(tables);
+  trace_stop(cfg, stop);
+  checkpoint_stop(cfg, stop, merges, tokens);
+  return stop;
+}
+
+// Adds a special token, false when it is empty or already there
+static bool specials_add(Specials *sp, const char *data, size_t n) {
+  if (sp->offsets.count == 0)
+    da_append(&sp->offsets, 0);
+  for (size_t t = 0; t + 1 < sp->offsets.count; ++t) {
+    uint32_t start = sp->offsets.items[t];
+    if (sp->offsets.items[t + 1] - start == n &&
+        memcmp(sp->bytes.items + start, data, n) == 0)
+      return false;
+  }
+  if (n == 0)
+    return false;
+  sb_append_buf(&sp->bytes, data, n);
+  da_append(&sp->offsets, sp->bytes.count);
+  return true;
+}
+
+static size_t specials_count(const Specials *sp) {
+  return sp && sp->offsets.count ? sp->offsets.count - 1 : 0;
+}
+
+static uint32_t special_child(const Specials *sp, uint32_t state, uint8_t b) {
+  if (state == 0)
+    return sp->root[b];
+  for (uint32_t c = sp->nodes.items[state].child; c;
+       c = sp->nodes.items[c].sibling) {
+    if (sp->nodes.items[c].byte == b)
+      return c;
+  }
+  return 0;
+}
+
+static uint32_t specials_step(const Specials *sp, uint32_t state, uint8_t b) {
+  for (;;) {
+    uint32_t next = special_child(sp, state, b);
+    if (next || state == 0)
+      return next;
+    state = sp->nodes.items[state].fail;
+  }
+}
+
+// Builds the automaton over the tokens added so far: a trie of them spelled
+// backwards, then the fail and out links breadth first, each state from its
+// parent's.
+static void specials_build(Specials *sp) {
+  sp->nodes.count = 0;
+  da_append(&sp->nodes, ((Special_Node){.out = NO_SPECIAL, .token = NO_SPECIAL}));
+  memset(sp->root, 0, sizeof(sp->root));
+  memset(sp->last, 0, sizeof(sp->last));
+  sp->single = -1;
+  sp->longest = 0;
+
+  for (size_t t = 0; t < specials_count(sp); ++t) {
+    uint32_t start = sp->offsets.items[t], end = sp->offsets.items[t + 1];
+    uint32_t state = 0;
+    for (uint32_t k = end; k-- > start;) {
+      uint8_t b = sp->bytes.items[k];
+      uint32_t next = special_child(sp, state, b);
+      if (!next) {
+        next = sp->nodes.count;
+        da_append(&sp->nodes, ((Special_Node){
+                                  .sibling = sp->nodes.items[state].child,
+                                  .out = NO_SPECIAL,
+                                  .depth = sp->nodes.items[state].depth + 1,
+                                  .token = NO_SPECIAL,
+                                  .byte = b,
+                              }));
+        sp->nodes.items[state].child = next;
+        if (state == 0)
+          sp->root[b] = next;
+      }
+      state = next;
+    }
+    sp->nodes.items[state].token = t;
+    if (end - start > sp->longest)
+      sp->longest = end - start;
+    sp->last[(uint8_t)sp->bytes.items[end - 1]] = true;
+  }
+  for (int b = 0, lasts = 0; b < 256; ++b) {
+    if (sp->last[b])
+      sp->single = lasts++ == 0 ? b : -1;
+  }
+
+  size_t count = sp->nodes.count;
+  uint32_t *queue = malloc(count * sizeof(*queue));
+  CHAOS_ASSERT(queue != NULL && "Buy more RAM lol");
+  size_t head = 0, tail = 0;
+  queue[tail++] = 0;
+  while (head < tail) {
+    uint32_t u = queue[head++];
+    Special_Node *n = &sp->nodes.items[u];
+    n->out = n->token != NO_SPECIAL ? u : sp->nodes.items[n->fail].out;
+    for (uint32_t c = n->child; c; c = sp->nodes.items[c].sibling) {
+      sp->nodes.items[c].fail =
+          u == 0 ? 0 : specials_step(sp, n->fail, sp->nodes.items[c].byte);
+      queue[tail++] = c;
+    }
+  }
+  free(queue);
+}
+
+static void specials_free(Specials *sp) {
+  free(sp->offsets.items);
+  free(sp->bytes.items);
+  free(sp->nodes.items);
+  *sp = (Specials){0};
+}
+
+static void specials_scan_begin(Special_Scan *scan, const Specials *sp,
+                                const char *s, size_t n) {
+  scan->sp = sp;
+  scan->s = s;
+  scan->n = n;
+  scan->end = 0;
+  scan->hits.count = 0;
+}
+
+// Runs the automaton backwards from the end of the block starting at start,
+// plus the longest - 1 bytes after it where a token starting inside can end,
+// and keeps the longest token starting at each byte of the block. Blocks are
+// at least longest bytes, so no byte is read more than twice.
+static void specials_scan_block(Special_Scan *scan, size_t start) {
+  const Specials *sp = scan->sp;
+  size_t block = sp->longest > SPECIALS_BLOCK ? sp->longest : SPECIALS_BLOCK;
+  size_t end = scan->n - start > block ? start + block : scan->n;
+  size_t reach = sp->longest - 1;
+  size_t stop = scan->n - end > reach ? end + reach : scan->n;
+  scan->end = end;
+  scan->hits.count = 0;
+  if (sp->single >= 0 && !memchr(scan->s + start, sp->single, stop - start))
+    return;
+
+  uint32_t state = 0;
+  for (size_t i = stop; i-- > start;) {
+    uint8_t b = scan->s[i];
+    // At the root nothing matters until a byte some token ends with
+    if (state == 0 && !sp->last[b])
+      continue;
+    state = specials_step(sp, state, b);
+    uint32_t out = sp->nodes.items[state].out;
+    if (out != NO_SPECIAL && i < end)
+      da_append(&scan->hits, ((Special_Hit){
+                                 .at = i,
+                                 .token = sp->nodes.items[out].token,
+                             }));
+  }
+}
+
+// Finds the leftmost special token in s[i..n), the longest one of those
+// starting there, and returns where it starts with its length and index, or
+// n when there is none. i never goes back from one call to the next, and the
+// whole text costs at most two passes of the automaton, however the tokens
+// overlap.
+static size_t specials_next(Special_Scan *scan, size_t i, size_t *len,
+                            uint32_t *token) {
+  *len = 0;
+  if (specials_count(scan->sp) == 0)
+    return scan->n;
+
+  Special_Hits *hits = &scan->hits;
+  for (;;) {
+    while (hits->count > 0 && hits->items[hits->count - 1].at < i)
+      hits->count--;
+    if (hits->count > 0) {
+      Special_Hit hit = hits->items[hits->count - 1];
+      const Offsets *offsets = &scan->sp->offsets;
+      *len = offsets->items[hit.token + 1] - offsets->items[hit.token];
+      if (token)
+        *token = hit.token;
+      return hit.at;
+    }
+    if (i < scan->end)
+      i = scan->end;
+    if (i >= scan->n)
+      return scan->n;
+    specials_scan_block(scan, i);
+  }
+}
+
+// The special tokens stored in a model, ready to match
+static void specials_of_model(Specials *sp, const Model *m) {
+  for (uint32_t t = 0; t < m->special_count; ++t) {
+    uint32_t id = m->vocab_count + t;
+    specials_add(sp, (const char *)m->bytes + m->offsets[id],
+                 m->offsets[id + 1] - m->offsets[id]);
+  }
+  specials_build(sp);
+}
+
+enum { CHAR_LETTER, CHAR_DIGIT, CHAR_SPACE, CHAR_OTHER };
+
+// Bytes >= 0x80 count as letters, which keeps UTF-8 sequences inside words
+static int char_class(unsigned char c) {
+  if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80)
+    return CHAR_LETTER;
+  if (c >= '0' && c <= '9')
+    return CHAR_DIGIT;
+  if (c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f')
+    return CHAR_SPACE;
+  return CHAR_OTHER;
+}
+
+// End of the word starting at i, following GPT-2's split pattern
+//   's|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+
+static size_t word_end(const char *s, size_t n, size_t i) {
+  if (s[i] == '\'' && i + 1 < n) {
+    char a = s[i + 1];
+    if (a == 's' || a == 't' || a == 'm' || a == 'd')
+      return i + 2;
+    if (i + 2 < n) {
+      char b = s[i + 2];
+      if ((a == 'r' && b == 'e') || (a == 'v' && b == 'e') ||
+          (a == 'l' && b == 'l'))
+        return i + 3;
+    }
+  }
+
+  size_t j = i;
+  if (s[j] == ' ' && j + 1 < n && char_class(s[j + 1]) != CHAR_SPACE)
+    j++;
+
+  int c = char_class(s[j]);
+  if (c != CHAR_SPACE) {
+    while (j < n && char_class(s[j]) == c)
+      j++;
+    return j;
+  }
+
+  // Leave the last space of a run to the word following it
+  while (j < n && char_class(s[j]) == CHAR_SPACE)
+    j++;
+  if (j < n && j - i > 1)
+    j--;
+  return j;
+}
+
+static uint64_t sv_hash(const void *key, size_t key_size) {
+  (void)key_size;
+  const String_View *sv = key;
+  return chaos_hash_bytes(sv->data, sv->count);
+}
+
+static bool sv_eq(const void *a, const void *b, size_t key_size) {
+  (void)key_size;
+  const String_View *x = a;
+  const String_View *y = b;
+  return x->count == y->count && memcmp(x->data, y->data, x->count) == 0;
+}
+
+// Special tokens are left out, the words stop at them
+static void words_collect(String_View text, const Specials *specials,
+                          Words *words) {
+  words->counts = map_of(String_View, size_t, sv_hash, sv_eq);
+
+  Special_Scan scan = {0};
+  specials_scan_begin(&scan, specials, text.data, text.count);
+  for (size_t i = 0, len = 0; i < text.count; i += len) {
+    size_t at = specials_next(&scan, i, &len, NULL);
+    while (i < at) {
+      size_t end = word_end(text.data, at, i);
+      String_View word = sv_from_parts(text.data + i, end - i);
+
+      size_t id = map_insert(&words->counts, &word, NULL);
+      (*(size_t *)map_value(&words->counts, id))++;
+      da_append(&words->order, id);
+      i = end;
+    }
+  }
+  free(scan.hits.items);
+}
+
+static void words_free(Words *words) {
+  map_free(&words->counts);
+  free(words->order.items);
+  *words = (Words){0};
+}
+
+// Turns tokens trained on the distinct words back into the tokens of the
+// whole corpus, by replaying the words in order.
+static void words_expand(Words *words, Symbols *trained, Tokens *out) {
+  size_t *starts = malloc((words->counts.count + 1) * sizeof(*starts));
+  CHAOS_ASSERT(starts != NULL && "Buy more RAM lol");
+
+  size_t id = 0;
+  starts[0] = 0;
+  for (size_t i = 0; i < trained->count; ++i) {
+    if (sym_get(trained, i) == WORD_BREAK)
+      starts[++id] = i + 1;
+  }
+
+  for (size_t w = 0; w < words->order.count; ++w) {
+    size_t word = words->order.items[w];
+    for (size_t i = starts[word]; i + 1 < starts[word + 1]; ++i) {
+      da_append(out, sym_get(trained, i));
+    }
+  }
+
+  free(starts);
+}
+
+static void unique_append(Symbols *unique, Positions *freqs, const char *word,
+                          size_t n, size_t freq) {
+  for (size_t i = 0; i < n; ++i) {
+    sym_append(unique, (unsigned char)word[i]);
+  }
+  sym_append(unique, WORD_BREAK);
+  da_append(freqs, freq);
+}
+
+// Trains on distinct words laid out by unique_append, each position weighted
+// by how often its word occurs.
+static Stop train_unique(Symbols *unique, Positions *freqs, Merges *merges,
+                         int *next_token, Config *cfg) {
+  if (!checkpoint_begin(cfg, unique, freqs, merges, next_token))
+    return STOP_FAILED;
+
+  size_t *weight = malloc((unique->count ? unique->count : 1) *
+                          sizeof(*weight));
+  CHAOS_ASSERT(weight != NULL && "Buy more RAM lol");
+  for (size_t w = 0, i = 0; i < unique->count; ++i) {
+    weight[i] = freqs->items[w];
+    if (sym_get(unique, i) == WORD_BREAK)
+      w++;
+  }
+
+  return train_incremental(unique, weight, merges, next_token, cfg);
+}
+
+// Trains on the words of text instead of its raw bytes, so merges never cross
+// a word boundary and each distinct word is only stored and rewritten once.
+static Stop train_words(String_View text, Tokens *tokens, Merges *merges,
+                        int *next_token, Config *cfg) {
+  Words words = {0};
+  words_collect(text, cfg->specials, &words);
+
+  if (cfg->reference) {
+    Symbols all = {0};
+    for (size_t w = 0; w < words.order.count; ++w) {
+      String_View *word = map_key(&words.counts, words.order.items[w]);
+      for (size_t i = 0; i < word->count; ++i) {
+        sym_append(&all, (unsigned char)word->data[i]);
+      }
+      sym_append(&all, WORD_BREAK);
+    }
+
+    Stop stop = STOP_FAILED;
+    if (checkpoint_begin(cfg, &all, NULL, merges, next_token))
+      stop = train_reference(&all, merges, next_token, cfg);
+
+    for (size_t i = 0; i < all.count; ++i) {
+      if (sym_get(&all, i) != WORD_BREAK)
+        da_append(tokens, sym_get(&all, i));
+    }
+    symbols_free(&all);
+    words_free(&words);
+    return stop;
+  }
+
+  Symbols unique = {0};
+  Positions freqs = {0};
+  for (size_t id = 0; id < words.counts.count; ++id) {
+    String_View *word = map_key(&words.counts, id);
+    unique_append(&unique, &freqs, word->data, word->count,
+                  *(size_t *)map_value(&words.counts, id));
+  }
+
+  Stop stop = train_unique(&unique, &freqs, merges, next_token, cfg);
+  words_expand(&words, &unique, tokens);
+
+  symbols_free(&unique);
+  free(freqs.items);
+  words_free(&words);
+  return stop;
+}
+
+static char *pool_copy(Pool *p, const char *data, size_t n) {
+  if (p->count == 0 || p->used + n > p->size) {
+    p->size = n > POOL_BLOCK ? n : POOL_BLOCK;
+    char *block = malloc(p->size);
+    CHAOS_ASSERT(block != NULL && "Buy more RAM lol");
+    da_append(p, block);
+    p->used = 0;
+  }
+
+  char *copy = p->items[p->count - 1] + p->used;
+  memcpy(copy, data, n);
+  p->used += n;
+  p->bytes += n;
+  return copy;
+}
+
+static void pool_free(Pool *p) {
+  for (size_t i = 0; i < p->count; ++i) {
+    free(p->items[i]);
+  }
+  free(p->items);
+  *p = (Pool){0};
+}
+
+// Rough bytes held by the counts, the words plus a map entry, cached hash and
+// index slots per distinct word.
+static size_t stream_usage(Stream *st) {
+  size_t entry = st->counts.key_size + st->counts.value_size +
+                 sizeof(uint64_t) + 2 * sizeof(size_t);
+  return st->pool.bytes + st->counts.count * entry;
+}
+
+static int compare_words(const void *a, const void *b) {
+  const String_View *x = &((const Word_Count *)a)->word;
+  const String_View *y = &((const Word_Count *)b)->word;
+  int c = memcmp(x->data, y->data, x->count < y->count ? x->count : y->count);
+  if (c != 0)
+    return c;
+  return (x->count > y->count) - (x->count < y->count);
+}
+
+// The counts as an array sorted by word, so every run and the final merge
+// list the words in the same order.
+static Word_Count *stream_sorted(Stream *st) {
+  size_t count = st->counts.count;
+  Word_Count *sorted = malloc((count ? count : 1) * sizeof(*sorted));
+  CHAOS_ASSERT(sorted != NULL && "Buy more RAM lol");
+  for (size_t id = 0; id < count; ++id) {
+    sorted[id].word = *(String_View *)map_key(&st->counts, id);
+    sorted[id].count = *(size_t *)map_value(&st->counts, id);
+  }
+  qsort(sorted, count, sizeof(*sorted), compare_words);
+  return sorted;
+}
+
+// Run records are a uint32_t length, the word and a uint64_t count.
+static bool stream_spill(Stream *st) {
+  FILE *f = tmpfile();
+  if (!f) {
+    fprintf(stderr, "Cannot create spill file: %s\n", strerror(errno));
+    return false;
+  }
+
+  Word_Count *sorted = stream_sorted(st);
+  bool ok = true;
+  for (size_t i = 0; ok && i < st->counts.count; ++i) {
+    uint32_t len = (uint32_t)sorted[i].word.count;
+    uint64_t count = sorted[i].count;
+    ok = fwrite(&len, sizeof(len), 1, f) == 1 &&
+         fwrite(sorted[i].word.data, 1, len, f) == len &&
+         fwrite(&count, sizeof(count), 1, f) == 1;
+  }
+  free(sorted);
+
+  if (!ok || fflush(f) != 0 || fseek(f, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "Cannot write spill file: %s\n", strerror(errno));
+    fclose(f);
+    return false;
+  }
+
+  da_append(&st->runs, f);
+  map_clear(&st->counts);
+  pool_free(&st->pool);
+  return true;
+}
+
+static bool stream_add(Stream *st, const char *word, size_t n) {
+  String_View key = sv_from_parts(word, n);
+  bool inserted = false;
+  size_t id = map_insert(&st->counts, &key, &inserted);
+  if (inserted)
+    *(String_View *)map_key(&st->counts, id) =
+        sv_from_parts(pool_copy(&st->pool, word, n), n);
+  (*(size_t *)map_value(&st->counts, id))++;
+  st->words++;
+
+  if (st->budget && stream_usage(st) > st->budget)
+    return stream_spill(st);
+  return true;
+}
+
+// Counts the words of a file a chunk at a time. A word is only taken once
+// the text after it is in the buffer, since word_end looks up to two bytes
+// ahead and a word reaching the end of the buffer might continue in the next
+// chunk, so splitting matches reading the file whole.
+static bool stream_file(Stream *st, char *path) {
+  FILE *f = fopen(path, "rb");
+  if (!f) {
+    fprintf(stderr, "Cannot open file: <%s>\n", path);
+    return false;
+  }
+
+  size_t capacity = STREAM_CHUNK;
+  size_t n = 0;
+  char *buf = malloc(capacity);
+  CHAOS_ASSERT(buf != NULL && "Buy more RAM lol");
+  Special_Scan scan = {0};
+
+  bool ok = true;
+  for (bool eof = false; ok && !eof;) {
+    if (n == capacity) {
+      capacity *= 2;
+      buf = realloc(buf, capacity);
+      CHAOS_ASSERT(buf != NULL && "Buy more RAM lol");
+    }
+
+    size_t got = fread(buf + n, 1, capacity - n, f);
+    if (got < capacity - n) {
+      if (ferror(f)) {
+        fprintf(stderr, "Cannot read file: <%s>\n", path);
+        ok = false;
+        break;
+      }
+      eof = true;
+    }
+    n += got;
+    st->bytes += got;
+
+    // Until eof, the last word may go on in the next read, and so may any
+    // special token starting in the last longest bytes
+    size_t longest = st->specials ? st->specials->longest : 0;
+    size_t tail = eof ? n : n - (n < longest ? n : longest);
+    size_t i = 0;
+    specials_scan_begin(&scan, st->specials, buf, n);
+    while (ok && i < n) {
+      size_t len = 0;
+      size_t at = specials_next(&scan, i, &len, NULL);
+      bool last = !eof && at >= tail;
+      while (ok && i < (last ? n : at)) {
+        size_t end = word_end(buf, last ? n : at, i);
+        if (last && (end >= n || i + 2 >= n || end > tail))
+          break;
+        ok = stream_add(st, buf + i, end - i);
+        i = end;
+      }
+      if (last || at == n)
+        break;
+      st->special_hits++;
+      i = at + len;
+    }
+    memmove(buf, buf + i, n - i);
+    n -= i;
+  }
+
+  free(scan.hits.items);
+  free(buf);
+  fclose(f);
+  return ok;
+}
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Streams a file, or every file below a directory in name order, skipping
+// hidden entries. Symlinks to directories are only followed when given as
+// the path itself, so a link back up the tree cannot recurse forever.
+static bool stream_path(Stream *st, char *path, bool top) {
+  struct stat info;
+  bool ok = lstat(path, &info) == 0;
+  bool link = ok && S_ISLNK(info.st_mode);
+  if (!ok || (link && stat(path, &info) != 0)) {
+    fprintf(stderr, "Cannot open file: <%s>\n", path);
+    return false;
+  }
+  if (link && !top && S_ISDIR(info.st_mode))
+    return true;
+  if (!S_ISDIR(info.st_mode))
+    return stream_file(st, path);
+
+  DIR *dir = opendir(path);
+  if (!dir) {
+    fprintf(stderr, "Cannot open directory: <%s>\n", path);
+    return false;
+  }
+
+  Paths children = {0};
+  for (struct dirent *e; (e = readdir(dir)) != NULL;) {
+    if (e->d_name[0] == '.')
+      continue;
+    char *child = strdup(temp_sprintf("%s/%s", path, e->d_name));
+    CHAOS_ASSERT(child != NULL && "Buy more RAM lol");
+    da_append(&children, child);
+  }
+  closedir(dir);
+
+  qsort(children.items, children.count, sizeof(*children.items),
+        compare_paths);
+  for (size_t i = 0; i < children.count; ++i) {
+    ok = ok && stream_path(st, children.items[i], false);
+    free(children.items[i]);
+  }
+  free(children.items);
+  return ok;
+}
+
+static bool run_read(FILE *f, String_Builder *word, uint64_t *count) {
+  uint32_t len = 0;
+  if (fread(&len, sizeof(len), 1, f) != 1)
+    return false;
+  da_reserve(word, len);
+  word->count = len;
+  return fread(word->items, 1, len, f) == len &&
+         fread(count, sizeof(*count), 1, f) == 1;
+}
+
+// Lays the distinct words out for training in sorted order, summing the
+// counts of a word across runs with a k-way merge when anything was spilled.
+static bool stream_finish(Stream *st, Symbols *unique, Positions *freqs) {
+  if (st->runs.count == 0) {
+    Word_Count *sorted = stream_sorted(st);
+    for (size_t i = 0; i < st->counts.count; ++i) {
+      unique_append(unique, freqs, sorted[i].word.data, sorted[i].word.count,
+                    sorted[i].count);
+    }
+    free(sorted);
+    return true;
+  }
+
+  if (st->counts.count > 0 && !stream_spill(st))
+    return false;
+
+  size_t k = st->runs.count;
+  String_Builder *heads = calloc(k, sizeof(*heads));
+  uint64_t *counts = calloc(k, sizeof(*counts));
+  bool *live = calloc(k, sizeof(*live));
+  CHAOS_ASSERT(heads && counts && live && "Buy more RAM lol");
+  for (size_t r = 0; r < k; ++r) {
+    live[r] = run_read(st->runs.items[r], &heads[r], &counts[r]);
+  }
+
+  String_Builder word = {0};
+  for (;;) {
+    size_t min = k;
+    for (size_t r = 0; r < k; ++r) {
+      if (!live[r])
+        continue;
+      if (min == k) {
+        min = r;
+        continue;
+      }
+      Word_Count a = {sb_to_sv(&heads[r]), 0};
+      Word_Count b = {sb_to_sv(&heads[min]), 0};
+      if (compare_words(&a, &b) < 0)
+        min = r;
+    }
+    if (min == k)
+      break;
+
+    word.count = 0;
+    sb_append_buf(&word, heads[min].items, heads[min].count);
+    uint64_t freq = 0;
+    for (size_t r = 0; r < k; ++r) {
+      if (live[r] && heads[r].count == word.count &&
+          memcmp(heads[r].items, word.items, word.count) == 0) {
+        freq += counts[r];
+        live[r] = run_read(st->runs.items[r], &heads[r], &counts[r]);
+      }
+    }
+    unique_append(unique, freqs, word.items, word.count, freq);
+  }
+
+  for (size_t r = 0; r < k; ++r) {
+    free(heads[r].items);
+    fclose(st->runs.items[r]);
+    st->runs.items[r] = NULL;
+  }
+  free(heads);
+  free(counts);
+  free(live);
+  free(word.items);
+  return true;
+}
+
+// Also closes the runs of a stream that failed before stream_finish
+static void stream_free(Stream *st) {
+  for (size_t r = 0; r < st->runs.count; ++r) {
+    if (st->runs.items[r])
+      fclose(st->runs.items[r]);
+  }
+  map_free(&st->counts);
+  pool_free(&st->pool);
+  free(st->runs.items);
+  *st = (Stream){0};
+}
+
+static void vocab_build(Merges *merges, Vocab *v) {
+  da_append(&v->offsets, 0);
+  for (int b = 0; b < 256; ++b) {
+    da_append(&v->bytes, (char)b);
+    da_append(&v->offsets, v->bytes.count);
+  }
+
+  for (size_t m = 0; m < merges->count; ++m) {
+    int halves[2] = {merges->items[m].left, merges->items[m].right};
+    for (int h = 0; h < 2; ++h) {
+      for (uint32_t k = v->offsets.items[halves[h]];
+           k < v->offsets.items[halves[h] + 1]; ++k) {
+        da_append(&v->bytes, v->bytes.items[k]);
+      }
+    }
+    da_append(&v->offsets, v->bytes.count);
+  }
+}
+
+static void vocab_free(Vocab *v) {
+  free(v->offsets.items);
+  free(v->bytes.items);
+  *v = (Vocab){0};
+}
+
+// Lays out the model file of merges in out
+static void model_serialize(Merges *merges, const Specials *specials,
+                            String_Builder *out) {
+  Vocab v = {0};
+  vocab_build(merges, &v);
+  size_t vocab_count = v.offsets.count - 1;
+  size_t special_count = specials_count(specials);
+  for (size_t t = 0; t < special_count; ++t) {
+    sb_append_buf(&v.bytes, specials->bytes.items + specials->offsets.items[t],
+                  specials->offsets.items[t + 1] - specials->offsets.items[t]);
+    da_append(&v.offsets, v.bytes.count);
+  }
+
+  String_Builder body = {0};
+  for (size_t m = 0; m < merges->count; ++m) {
+    Model_Merge mm = {merges->items[m].left, merges->items[m].right};
+    sb_append_buf(&body, &mm, sizeof(mm));
+  }
+  sb_append_buf(&body, v.offsets.items, v.offsets.count * sizeof(*v.offsets.items));
+  sb_append_buf(&body, v.bytes.items, v.bytes.count);
+
+  Model_Header h = {
+      .version = MODEL_VERSION,
+      .merge_count = merges->count,
+      .vocab_count = vocab_count,
+      .vocab_bytes = v.bytes.count,
+      .checksum = chaos_hash_bytes(body.items, body.count),
+      .special_count = special_count,
+  };
+  memcpy(h.magic, MODEL_MAGIC, sizeof(h.magic));
+
+  sb_append_buf(out, &h, sizeof(h));
+  sb_append_buf(out, body.items, body.count);
+
+  free(body.items);
+  vocab_free(&v);
+}
+
+// GPT-2's byte to unicode table: printable bytes stand for themselves, the
+// rest are shifted to code points from 256 on so no token shows whitespace.
+static void byte_to_utf8(unsigned char b, String_Builder *out) {
+  int cp = b;
+  if (!((b >= '!' && b <= '~') || (b >= 0xA1 && b <= 0xAC) || b >= 0xAE)) {
+    cp = 256;
+    for (int c = 0; c < b; ++c) {
+      if (!((c >= '!' && c <= '~') || (c >= 0xA1 && c <= 0xAC) || c >= 0xAE))
+        cp++;
+    }
+  }
+
+  if (cp < 0x80) {
+    da_append(out, (char)cp);
+  } else {
+    da_append(out, (char)(0xC0 | (cp >> 6)));
+    da_append(out, (char)(0x80 | (cp & 0x3F)));
+  }
+}
+
+// The usual merges.txt layout, one "left right" merge per line after a
+// version header, tokens spelled with byte_to_utf8.
+static bool model_save_text(char *path, const Model *m) {
+  String_Builder out = {0};
+  sb_append_cstr(&out, "#version: 0.2\n");
+  for (uint32_t r = 0; r < m->merge_count; ++r) {
+    int32_t halves[2] = {m->merges[r].left, m->merges[r].right};
+    for (int h = 0; h < 2; ++h) {
+      for (uint32_t k = m->offsets[halves[h]]; k < m->offsets[halves[h] + 1];
+           ++k) {
+        byte_to_utf8(m->bytes[k], &out);
+      }
+      da_append(&out, h == 0 ? ' ' : '\n');
+    }
+  }
+  bool ok = write_file(path, &out);
+
+  free(out.items);
+  return ok;
+}
+
+// Points m into a model file already in memory, if it is a valid one
+// The checksum only catches accidents, so everything decoding and encoding
+// index with is checked once here: merges only refer to earlier tokens,
+// offsets start at 0, never go back and end at vocab_bytes, the first 256
+// tokens are their own byte, and special tokens are distinct and not empty.
+static bool model_valid(uint32_t merge_count, uint32_t vocab_count,
+                        uint32_t special_count, uint64_t vocab_bytes,
+                        const Model_Merge *merges, const uint32_t *offsets,
+                        const uint8_t *bytes) {
+  for (uint32_t i = 0; i < merge_count; ++i) {
+    int64_t limit = 256 + (int64_t)i;
+    if (merges[i].left < 0 || merges[i].left >= limit || merges[i].right < 0 ||
+        merges[i].right >= limit)
+      return false;
+  }
+
+  size_t count = (size_t)vocab_count + special_count;
+  if (offsets[0] != 0 || offsets[count] != vocab_bytes)
+    return false;
+  for (size_t id = 0; id < count; ++id) {
+    if (offsets[id + 1] < offsets[id])
+      return false;
+  }
+  for (uint32_t b = 0; b < 256; ++b) {
+    if (offsets[b + 1] - offsets[b] != 1 || bytes[offsets[b]] != b)
+      return false;
+  }
+
+  for (size_t t = vocab_count; t < count; ++t) {
+    uint32_t n = offsets[t + 1] - offsets[t];
+    if (n == 0)
+      return false;
+    for (size_t u = vocab_count; u < t; ++u) {
+      if (offsets[u + 1] - offsets[u] == n &&
+          memcmp(bytes + offsets[u], bytes + offsets[t], n) == 0)
+        return false;
+    }
+  }
+  return true;
+}
+
+static bool model_parse(const void *data, size_t size, Model *m) {
+  if (size < MODEL_HEADER_V1)
+    return false;
+
+  const Model_Header *h = data;
+  size_t header = h->version == 1 ? MODEL_HEADER_V1 : sizeof(*h);
+  if (size < header)
+    return false;
+  const uint8_t *body = (const uint8_t *)data + header;
+  size_t body_size = size - header;
+  uint32_t special_count = h->version == 1 ? 0 : h->special_count;
+
+  bool ok = memcmp(h->magic, MODEL_MAGIC, sizeof(h->magic)) == 0 &&
+            (h->version == 1 || h->version == MODEL_VERSION) &&
+            h->vocab_count == 256 + (uint64_t)h->merge_count &&
+            body_size == h->merge_count * sizeof(Model_Merge) +
+                             (h->vocab_count + special_count + 1ULL) *
+                                 sizeof(uint32_t) +
+                             h->vocab_bytes &&
+            chaos_hash_bytes(body, body_size) == h->checksum;
+  if (!ok)
+    return false;
+
+  const Model_Merge *merges = (const Model_Merge *)body;
+  const uint32_t *offsets = (const uint32_t *)(merges + h->merge_count);
+  const uint8_t *bytes = (const uint8_t *)(offsets + h->vocab_count +
+                                           special_count + 1);
+  if (!model_valid(h->merge_count, h->vocab_count, special_count,
+                   h->vocab_bytes, merges, offsets, bytes))
+    return false;
+
+  m->merge_count = h->merge_count;
+  m->vocab_count = h->vocab_count;
+  m->special_count = special_count;
+  m->merges = merges;
+  m->offsets = offsets;
+  m->bytes = bytes;
+  return true;
+}
+
+static bool model_load(char *path, Model *m) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Cannot open file: <%s>\n", path);
+    return false;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < MODEL_HEADER_V1) {
+    fprintf(stderr, "Not a model file: <%s>\n", path);
+    close(fd);
+    return false;
+  }
+
+  size_t size = st.st_size;
+  void *mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) {
+    fprintf(stderr, "Cannot map file: <%s>\n", path);
+    return false;
+  }
+
+  if (!model_parse(mapping, size, m)) {
+    fprintf(stderr, "Corrupt or incompatible model file: <%s>\n", path);
+    munmap(mapping, size);
+    return false;
+  }
+  m->mapping = mapping;
+  m->mapping_size = size;
+  return true;
+}
+
+static void model_close(Model *m) {
+  if (m->mapping)
+    munmap(m->mapping, m->mapping_size);
+  *m = (Model){0};
+}
+
+static Decoder decoder_of_model(Model *m) {
+  return (Decoder){
+      .offsets = m->offsets,
+      .bytes = m->bytes,
+      .vocab_count = m->vocab_count + m->special_count,
+  };
+}
+
+// Writes the bytes of tokens into out and returns how many there are in
+// total, copying only while they fit in capacity, so a call with a NULL
+// buffer sizes the output. Stops at the first id outside the vocab and
+// stores its index in bad, which is SIZE_MAX otherwise.
+static size_t decode_tokens(Decoder *d, const int *tokens, size_t count,
+                            char *out, size_t capacity, size_t *bad) {
+  size_t size = 0;
+  *bad = SIZE_MAX;
+  for (size_t i = 0; i < count; ++i) {
+    uint32_t t = (uint32_t)tokens[i];
+    if (t >= d->vocab_count) {
+      *bad = i;
+      break;
+    }
+    size_t len = d->offsets[t + 1] - d->offsets[t];
+    if (size + len <= capacity)
+      memcpy(out + size, d->bytes + d->offsets[t], len);
+    size += len;
+  }
+  return size;
+}
+
+// Words at most this long are encoded by rescanning them after every merge,
+// which beats maintaining a heap for them.
+#define ENCODE_SHORT 32
+
+static void encoder_init(Encoder *e, Model *m) {
+  e->model = m;
+  e->specials = (Specials){0};
+  specials_of_model(&e->specials, m);
+  e->ranks = (Pair_Table){0};
+  pair_table_reserve(&e->ranks, m->merge_count);
+  memset(e->joins, 0, sizeof(e->joins));
+  for (uint32_t r = 0; r < m->merge_count; ++r) {
+    int left = m->merges[r].left, right = m->merges[r].right;
+    *pair_table_at(&e->ranks, pair_key(left, right)) = r;
+    uint8_t x = m->bytes[m->offsets[left + 1] - 1];
+    uint8_t y = m->bytes[m->offsets[right]];
+    e->joins[x][y / 64] |= 1ULL << (y % 64);
+  }
+}
+
+static void encoder_free(Encoder *e) {
+  specials_free(&e->specials);
+  pair_table_free(&e->ranks);
+}
+
+static void scratch_free(Scratch *s) {
+  symbols_free(&s->symbols);
+  free(s->prev.items);
+  free(s->next.items);
+  free(s->sites.items);
+  free(s->heads);
+  free(s->pending.items);
+  free(s->batch.items);
+  free(s->cache.slots);
+  free(s->specials.hits.items);
+  *s = (Scratch){0};
+}
+
+static size_t rank_of(Encoder *e, int left, int right) {
+  size_t *rank = pair_table_find(&e->ranks, pair_key(left, right));
+  return rank ? *rank : SIZE_MAX;
+}
+
+static void pending_push(Scratch *s, uint32_t rank) {
+  da_append(&s->pending, rank);
+  uint32_t *h = s->pending.items;
+  for (size_t i = s->pending.count - 1; i > 0;) {
+    size_t parent = (i - 1) / 2;
+    if (h[parent] <= h[i])
+      break;
+    uint32_t tmp = h[i];
+    h[i] = h[parent];
+    h[parent] = tmp;
+    i = parent;
+  }
+}
+
+static uint32_t pending_pop(Scratch *s) {
+  uint32_t *h = s->pending.items;
+  uint32_t top = h[0];
+  h[0] = h[--s->pending.count];
+
+  for (size_t i = 0;;) {
+    size_t child = i * 2 + 1;
+    if (child >= s->pending.count)
+      break;
+    if (child + 1 < s->pending.count && h[child + 1] < h[child])
+      child++;
+    if (h[i] <= h[child])
+      break;
+    uint32_t tmp = h[i];
+    h[i] = h[child];
+    h[child] = tmp;
+    i = child;
+  }
+  return top;
+}
+
+static void site_push(Encoder *e, Scratch *s, size_t pos) {
+  size_t nxt = s->next.items[pos];
+  if (nxt == NO_POS)
+    return;
+
+  size_t rank =
+      rank_of(e, sym_get(&s->symbols, pos), sym_get(&s->symbols, nxt));
+  if (rank == SIZE_MAX)
+    return;
+
+  if (s->heads[rank] == 0)
+    pending_push(s, rank);
+  da_append(&s->sites, ((Site){.pos = pos, .next = s->heads[rank]}));
+  s->heads[rank] = s->sites.count;
+}
+
+// Linked list over the bytes plus one bucket of candidate sites per merge
+// rank. A merge only ever creates pairs of a higher rank than its own, so the
+// ranks are drained in increasing order and each site is touched once.
+static void encode_long(Encoder *e, Scratch *s, const char *bytes, size_t n,
+                        Tokens *out) {
+  if (!s->heads) {
+    s->heads = calloc(e->model->merge_count + 1, sizeof(*s->heads));
+    CHAOS_ASSERT(s->heads != NULL && "Buy more RAM lol");
+  }
+
+  Symbols *sym = &s->symbols;
+  sym->count = 0;
+  symbols_fit(sym, e->model->vocab_count - 1);
+  symbols_reserve(sym, n);
+  da_reserve(&s->prev, n);
+  da_reserve(&s->next, n);
+  size_t *prev = s->prev.items;
+  size_t *next = s->next.items;
+
+  for (size_t i = 0; i < n; ++i) {
+    sym_set(sym, i, (unsigned char)bytes[i]);
+    prev[i] = i == 0 ? NO_POS : i - 1;
+    next[i] = i + 1 == n ? NO_POS : i + 1;
+  }
+
+  s->sites.count = 0;
+  s->pending.count = 0;
+  for (size_t i = 0; i + 1 < n; ++i) {
+    site_push(e, s, i);
+  }
+
+  while (s->pending.count > 0) {
+    uint32_t rank = pending_pop(s);
+    int A = e->model->merges[rank].left;
+    int B = e->model->merges[rank].right;
+
+    s->batch.count = 0;
+    for (size_t h = s->heads[rank]; h != 0; h = s->sites.items[h - 1].next) {
+      da_append(&s->batch, s->sites.items[h - 1].pos);
+    }
+    s->heads[rank] = 0;
+
+    // Only runs like AAA care about the order, left to right like training
+    if (A == B)
+      qsort(s->batch.items, s->batch.count, sizeof(*s->batch.items),
+            compare_positions);
+
+    for (size_t b = 0; b < s->batch.count; ++b) {
+      size_t i = s->batch.items[b];
+      size_t j = next[i];
+      if (sym_get(sym, i) != A || j == NO_POS || sym_get(sym, j) != B)
+        continue;
+
+      size_t k = next[j];
+      sym_set(sym, i, 256 + rank);
+      sym_set(sym, j, DEAD_TOKEN);
+      next[i] = k;
+      if (k != NO_POS)
+        prev[k] = i;
+
+      if (prev[i] != NO_POS)
+        site_push(e, s, prev[i]);
+      site_push(e, s, i);
+    }
+  }
+
+  for (size_t i = 0; i != NO_POS; i = next[i]) {
+    da_append(out, sym_get(sym, i));
+  }
+}
+
+// Keeps the rank of every adjacent pair next to the symbols, so a merge only
+// looks up the two pairs it changed.
+static void encode_short(Encoder *e, const char *bytes, size_t n, Tokens *out) {
+  int sym[ENCODE_SHORT];
+  size_t ranks[ENCODE_SHORT];
+
+  for (size_t i = 0; i < n; ++i) {
+    sym[i] = (unsigned char)bytes[i];
+  }
+  for (size_t i = 0; i + 1 < n; ++i) {
+    ranks[i] = rank_of(e, sym[i], sym[i + 1]);
+  }
+
+  while (n > 1) {
+    size_t best = 0;
+    for (size_t i = 1; i + 1 < n; ++i) {
+      if (ranks[i] < ranks[best])
+        best = i;
+    }
+    if (ranks[best] == SIZE_MAX)
+      break;
+
+    sym[best] = 256 + ranks[best];
+    memmove(sym + best + 1, sym + best + 2, (n - best - 2) * sizeof(*sym));
+    memmove(ranks + best + 1, ranks + best + 2,
+            (n > best + 2 ? n - best - 3 : 0) * sizeof(*ranks));
+    n--;
+
+    if (best > 0)
+      ranks[best - 1] = rank_of(e, sym[best - 1], sym[best]);
+    if (best + 1 < n)
+      ranks[best] = rank_of(e, sym[best], sym[best + 1]);
+  }
+
+  for (size_t i = 0; i < n; ++i) {
+    da_append(out, sym[i]);
+  }
+}
+
+static void encode_bytes(Encoder *e, Scratch *s, const char *bytes, size_t n,
+                         Tokens *out) {
+  if (n == 0)
+    return;
+  if (n <= ENCODE_SHORT)
+    encode_short(e, bytes, n, out);
+  else
+    encode_long(e, s, bytes, n, out);
+}
+
+// Encodes one word through the cache of s
+static void encode_word(Encoder *e, Scratch *s, const char *bytes, size_t n,
+                        Tokens *out) {
+  if (e->cache_size == 0 || n > CACHE_WORD) {
+    encode_bytes(e, s, bytes, n, out);
+    return;
+  }
+
+  Cache *c = &s->cache;
+  if (!c->slots) {
+    c->capacity = CACHE_WAYS;
+    while (c->capacity < e->cache_size)
+      c->capacity *= 2;
+    c->slots = calloc(c->capacity, sizeof(*c->slots));
+    CHAOS_ASSERT(c->slots != NULL && "Buy more RAM lol");
+  }
+
+  uint64_t hash = chaos_hash_bytes(bytes, n) | 1;
+  size_t buckets = c->capacity / CACHE_WAYS;
+  Cache_Slot *bucket = c->slots + (hash & (buckets - 1)) * CACHE_WAYS;
+  uint32_t tick = ++c->tick;
+
+  // Unsigned ages stay right when the tick wraps around
+  Cache_Slot *victim = NULL;
+  for (size_t w = 0; w < CACHE_WAYS; ++w) {
+    Cache_Slot *slot = &bucket[w];
+    if (slot->hash == hash && slot->length == n &&
+        memcmp(slot->bytes, bytes, n) == 0) {
+      c->hits++;
+      if (e->cache_policy == CACHE_LRU)
+        slot->stamp = tick;
+      da_reserve(out, out->count + slot->count);
+      for (size_t t = 0; t < slot->count; ++t) {
+        out->items[out->count++] = slot->tokens[t];
+      }
+      return;
+    }
+    if (!victim || (victim->hash != 0 &&
+                    (slot->hash == 0 ||
+                     (uint32_t)(tick - slot->stamp) >
+                         (uint32_t)(tick - victim->stamp))))
+      victim = slot;
+  }
+
+  c->misses++;
+  size_t start = out->count;
+  encode_bytes(e, s, bytes, n, out);
+  size_t count = out->count - start;
+  if (count > CACHE_TOKENS)
+    return;
+
+  if (victim->hash != 0)
+    c->evictions++;
+  victim->hash = hash;
+  victim->stamp = tick;
+  victim->length = n;
+  victim->count = count;
+  memcpy(victim->bytes, bytes, n);
+  for (size_t t = 0; t < count; ++t) {
+    victim->tokens[t] = out->items[start + t];
+  }
+}
+
+static bool joins(const Encoder *e, uint8_t x, uint8_t y) {
+  return (e->joins[x][y / 64] >> (y % 64)) & 1;
+}
+
+static void encode_piece(Encoder *e, Scratch *s, const char *data, size_t n,
+                         bool words, Tokens *out) {
+  if (!words) {
+    // Each piece fits in cache, where the whole text would not
+    for (size_t i = 0; i < n;) {
+      size_t end = i + 1;
+      while (end < n && joins(e, data[end - 1], data[end]))
+        end++;
+      encode_bytes(e, s, data + i, end - i, out);
+      i = end;
+    }
+    return;
+  }
+
+  for (size_t i = 0; i < n;) {
+    size_t end = word_end(data, n, i);
+    encode_word(e, s, data + i, end - i, out);
+    i = end;
+  }
+}
+
+// Appends the tokens of text to out. With words set, text is split the same
+// way --words training splits it and every word is encoded on its own. Special
+// tokens are cut out first and never reach the merges.
+static void encode(Encoder *e, Scratch *s, String_View text, bool words,
+                   Tokens *out) {
+  specials_scan_begin(&s->specials, &e->specials, text.data, text.count);
+  for (size_t i = 0;;) {
+    size_t len = 0;
+    uint32_t special = 0;
+    size_t at = specials_next(&s->specials, i, &len, &special);
+    encode_piece(e, s, text.data + i, at - i, words, out);
+    if (at == text.count)
+      break;
+    da_append(out, e->model->vocab_count + special);
+    i = at + len;
+  }
+}
+
+// Documents are handed out this many at a time
+#define BATCH_CHUNK 16
+
+static void batch_init(Batch *b, Encoder *e, bool words, size_t threads) {
+  *b = (Batch){.encoder = e, .words = words, .threads = threads};
+  b->workers = calloc(threads, sizeof(*b->workers));
+  CHAOS_ASSERT(b->workers != NULL && "Buy more RAM lol");
+  for (size_t k = 0; k < threads; ++k) {
+    b->workers[k].batch = b;
+    b->workers[k].id = k;
+  }
+}
+
+static void batch_free(Batch *b) {
+  for (size_t k = 0; k < b->threads; ++k) {
+    scratch_free(&b->workers[k].scratch);
+    free(b->workers[k].out.items);
+  }
+  free(b->workers);
+  free(b->docs.items);
+  free(b->offsets.items);
+  region_free(&b->region);
+  *b = (Batch){0};
+}
+
+// Claims the next chunk of w, SIZE_MAX once it has none left. Owner and
+// thieves both take from the front, so claiming is a single fetch_add.
+static size_t batch_claim(Batch_Worker *w) {
+  if (__atomic_load_n(&w->next, __ATOMIC_RELAXED) >= w->end)
+    return SIZE_MAX;
+  size_t chunk = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED);
+  return chunk < w->end ? chunk : SIZE_MAX;
+}
+
+static void *batch_worker(void *arg) {
+  Batch_Worker *w = arg;
+  Batch *b = w->batch;
+  w->out.count = 0;
+
+  // Own chunks first, then steal from the others in turn until all are dry
+  for (size_t v = 0; v < b->threads; ++v) {
+    Batch_Worker *victim = &b->workers[(w->id + v) % b->threads];
+    for (size_t chunk; (chunk = batch_claim(victim)) != SIZE_MAX;) {
+      size_t first = chunk * BATCH_CHUNK;
+      size_t last = first + BATCH_CHUNK < b->input_count ? first + BATCH_CHUNK
+                                                         : b->input_count;
+      for (size_t d = first; d < last; ++d) {
+        size_t start = w->out.count;
+        encode(b->encoder, &w->scratch, b->inputs[d], b->words, &w->out);
+        b->docs.items[d] = (Batch_Doc){
+            .worker = w->id,
+            .start = start,
+            .count = w->out.count - start,
+        };
+      }
+    }
+  }
+  return NULL;
+}
+
+// Encodes inputs[0..count) into the workers' buffers and b->offsets,
+// replacing what the previous call left there. batch_gather then copies the
+// tokens out.
+static void encode_batch(Batch *b, const String_View *inputs, size_t count) {
+  b->inputs = inputs;
+  b->input_count = count;
+  b->docs.count = 0;
+  da_reserve(&b->docs, count);
+  b->docs.count = count;
+
+  size_t chunks = (count + BATCH_CHUNK - 1) / BATCH_CHUNK;
+  size_t threads = b->threads < chunks ? b->threads : (chunks ? chunks : 1);
+  for (size_t k = 0; k < b->threads; ++k) {
+    Batch_Worker *w = &b->workers[k];
+    w->next = k < threads ? chunks * k / threads : 0;
+    w->end = k < threads ? chunks * (k + 1) / threads : 0;
+  }
+  region_reset(&b->region);
+  run_parallel(batch_worker, b->workers, sizeof(*b->workers), threads,
+               &b->region);
+
+  // Offsets follow document order, not the order the workers got to them
+  b->offsets.count = 0;
+  da_reserve(&b->offsets, count + 1);
+  b->offsets.items[b->offsets.count++] = 0;
+  size_t total = 0;
+  for (size_t d = 0; d < count; ++d) {
+    total += b->docs.items[d].count;
+    b->offsets.items[b->offsets.count++] = total;
+  }
+}
+
+// Copies the tokens of the last batch to out, which holds offsets.items[count]
+static void batch_gather(Batch *b, int *out) {
+  for (size_t d = 0; d < b->input_count; ++d) {
+    Batch_Doc *doc = &b->docs.items[d];
+    if (doc->count > 0)
+      memcpy(out + b->offsets.items[d],
+             b->workers[doc->worker].out.items + doc->start,
+             doc->count * sizeof(*out));
+  }
+}
+
+
+// Sums the counters of the per thread caches
+static void cache_add(Cache *total, const Cache *c) {
+  total->hits += c->hits;
+  total->misses += c->misses;
+  total->evictions += c->evictions;
+}
+
+// What a Bpe handle is. The model either maps a loaded file or points into
+// built, the file of the last training run laid out in memory. tokens, views
+// and the scratch buffers are reused by every encode.
+struct Bpe {
+  Config cfg;
+  bool keep_tokens;
+  Specials specials;
+  Merges merges;
+  Tokens trained;
+  String_Builder built;
+  Model model;
+  bool ready;
+  Encoder encoder;
+  Scratch scratch;
+  Batch batch;
+  Tokens tokens;
+  Views views;
+};
+
+static const char *status_names[] = {
+    [BPE_OK] = "ok",
+    [BPE_ERROR_IO] = "cannot read or write file",
+    [BPE_ERROR_ARGUMENT] = "invalid argument",
+    [BPE_ERROR_BUFFER] = "buffer too small",
+    [BPE_ERROR_STATE] = "no model",
+    [BPE_ERROR_UNSUPPORTED] = "not supported by this build",
+};
+
+void bpe_options_init(Bpe_Options *options) {
+  *options = (Bpe_Options){
+      .threads = 1,
+      .min_frequency = 2,
+      .cache_size = ENCODE_CACHE,
+  };
+}
+
+Bpe_Status bpe_create(const Bpe_Options *options, Bpe **bpe) {
+  const Bpe_Options *o = options;
+  if (o->threads < 1 || o->min_frequency < 2 ||
+      (o->vocab_size != 0 && (size_t)o->vocab_size < 256 + o->special_count) ||
+      o->max_seconds < 0 || o->checkpoint_seconds < 0 ||
+      (!o->checkpoint && (o->checkpoint_every || o->checkpoint_seconds > 0)))
+    return BPE_ERROR_ARGUMENT;
+  if (o->stats_path && !STATS_ENABLED)
+    return BPE_ERROR_UNSUPPORTED;
+
+  FILE *trace = NULL;
+  if (o->stats_path) {
+    trace = fopen(o->stats_path, "w");
+    if (!trace) {
+      fprintf(stderr, "Cannot open file: <%s>\n", o->stats_path);
+      return BPE_ERROR_IO;
+    }
+  }
+
+  Bpe *b = calloc(1, sizeof(*b));
+  CHAOS_ASSERT(b != NULL && "Buy more RAM lol");
+  for (size_t t = 0; t < o->special_count; ++t) {
+    const char *token = o->specials[t];
+    if (!token || !specials_add(&b->specials, token, strlen(token))) {
+      specials_free(&b->specials);
+      free(b);
+      if (trace)
+        fclose(trace);
+      return BPE_ERROR_ARGUMENT;
+    }
+  }
+  specials_build(&b->specials);
+  b->cfg = (Config){
+      .reference = o->reference,
+      .words = o->words,
+      .cache_size = o->cache_size,
+      .cache_policy = (Cache_Policy)o->cache_policy,
+      .threads = o->threads,
+      .memory = o->memory,
+      // The special tokens come out of the merge budget
+      .vocab_size = o->vocab_size ? o->vocab_size - (int)o->special_count : 0,
+      .min_frequency = o->min_frequency,
+      .max_seconds = o->max_seconds,
+      .checkpoint =
+          {
+              .path = (char *)o->checkpoint,
+              .every = o->checkpoint_every,
+              .seconds = o->checkpoint_seconds,
+              .resume = (char *)o->resume,
+          },
+      .trace = {.path = (char *)o->stats_path, .file = trace},
+      .log = o->log,
+      .log_user = o->log_user,
+      .specials = &b->specials,
+  };
+  b->keep_tokens = o->keep_tokens;
+  *bpe = b;
+  return BPE_OK;
+}
+
+// Drops the model and everything built on it, the word caches included
+static void bpe_unload(Bpe *b) {
+  if (!b->ready)
+    return;
+  batch_free(&b->batch);
+  encoder_free(&b->encoder);
+  scratch_free(&b->scratch);
+  model_close(&b->model);
+  b->ready = false;
+}
+
+static void bpe_ready(Bpe *b) {
+  encoder_init(&b->encoder, &b->model);
+  b->encoder.cache_size = b->cfg.cache_size;
+  b->encoder.cache_policy = b->cfg.cache_policy;
+  batch_init(&b->batch, &b->encoder, b->cfg.words, b->cfg.threads);
+  b->ready = true;
+}
+
+void bpe_free(Bpe *bpe) {
+  if (!bpe)
+    return;
+  bpe_unload(bpe);
+  if (bpe->cfg.trace.file)
+    fclose(bpe->cfg.trace.file);
+  specials_free(&bpe->specials);
+  free(bpe->merges.items);
+  free(bpe->trained.items);
+  free(bpe->built.items);
+  free(bpe->tokens.items);
+  free(bpe->views.items);
+  free(bpe);
+}
+
+// Makes the merges just trained the model of b. The special tokens were left
+// out of training, so with any of them the corpus is encoded again to count
+// them in.
+static Bpe_Status bpe_trained(Bpe *b, Stop stop, String_View text,
+                              size_t tokens, int next_token,
+                              Bpe_Train_Result *result) {
+  if (stop == STOP_FAILED)
+    return BPE_ERROR_IO;
+
+  b->built.count = 0;
+  model_serialize(&b->merges, &b->specials, &b->built);
+  bool ok = model_parse(b->built.items, b->built.count, &b->model);
+  CHAOS_ASSERT(ok && "Model built from merges does not parse");
+  bpe_ready(b);
+
+  if (specials_count(&b->specials) > 0 && text.data) {
+    b->trained.count = 0;
+    encode(&b->encoder, &b->scratch, text, b->cfg.words, &b->trained);
+    tokens = b->trained.count;
+  }
+  if (!b->keep_tokens) {
+    free(b->trained.items);
+    b->trained = (Tokens){0};
+  }
+
+  if (result)
+    *result = (Bpe_Train_Result){
+        .tokens = tokens,
+        .vocab_size = next_token + specials_count(&b->specials),
+        .merges = b->merges.count,
+        .stop = (Bpe_Stop)stop,
+    };
+  return BPE_OK;
+}
+
+Bpe_Status bpe_train(Bpe *bpe, const char *text, size_t size,
+                     Bpe_Train_Result *result) {
+  if (!text && size > 0)
+    return BPE_ERROR_ARGUMENT;
+  Config *cfg = &bpe->cfg;
+  bpe_unload(bpe);
+  bpe->merges.count = 0;
+  bpe->trained.count = 0;
+  cfg->started = now();
+
+  Tokens *tokens = &bpe->trained;
+  int next_token = 256;
+  Stop stop = STOP_NONE;
+  if (cfg->words) {
+    stop = train_words(sv_from_parts(text, size), tokens, &bpe->merges,
+                       &next_token, cfg);
+  } else {
+    // A special token becomes a break, so no pair reaches across it
+    Symbols symbols = {0};
+    symbols_reserve(&symbols, size);
+    Special_Scan scan = {0};
+    specials_scan_begin(&scan, cfg->specials, text, size);
+    for (size_t i = 0, len = 0; i < size; i += len) {
+      size_t at = specials_next(&scan, i, &len, NULL);
+      for (; i < at; ++i) {
+        sym_set(&symbols, symbols.count++, (unsigned char)text[i]);
+      }
+      if (at < size)
+        sym_set(&symbols, symbols.count++, WORD_BREAK);
+    }
+    free(scan.hits.items);
+
+    if (!checkpoint_begin(cfg, &symbols, NULL, &bpe->merges, &next_token)) {
+      stop = STOP_FAILED;
+    } else if (cfg->reference) {
+      stop = train_reference(&symbols, &bpe->merges, &next_token, cfg);
+    } else {
+      stop = train_incremental(&symbols, NULL, &bpe->merges, &next_token, cfg);
+    }
+
+    da_reserve(tokens, symbols.count);
+    for (size_t i = 0; i < symbols.count; ++i) {
+      tokens->items[tokens->count++] = sym_get(&symbols, i);
+    }
+    symbols_free(&symbols);
+  }
+
+  return bpe_trained(bpe, stop, sv_from_parts(text, size), tokens->count,
+                     next_token, result);
+}
+
+// Trains on the words of every input without ever reading one whole, so only
+// the distinct words have to fit in memory.
+Bpe_Status bpe_train_files(Bpe *bpe, const char *const *paths, size_t count,
+                           Bpe_Train_Result *result) {
+  Config *cfg = &bpe->cfg;
+  if (cfg->reference || count == 0)
+    return BPE_ERROR_ARGUMENT;
+  bpe_unload(bpe);
+  bpe->merges.count = 0;
+  bpe->trained.count = 0;
+  cfg->started = now();
+
+  Stream st = {.budget = cfg->memory, .specials = cfg->specials};
+  st.counts = map_of(String_View, size_t, sv_hash, sv_eq);
+  Symbols unique = {0};
+  Positions freqs = {0};
+  bool ok = true;
+  for (size_t i = 0; ok && i < count; ++i) {
+    ok = stream_path(&st, (char *)paths[i], true);
+  }
+  if (!ok || !stream_finish(&st, &unique, &freqs)) {
+    stream_free(&st);
+    symbols_free(&unique);
+    free(freqs.items);
+    return BPE_ERROR_IO;
+  }
+  say(cfg, "Read %zu bytes, %zu words, %zu distinct", st.bytes, st.words,
+      freqs.count);
+  if (st.runs.count > 0)
+    say(cfg, "Spilled %zu runs", st.runs.count);
+  size_t total = st.special_hits;
+  stream_free(&st);
+
+  int next_token = 256;
+  Stop stop = train_unique(&unique, &freqs, &bpe->merges, &next_token, cfg);
+
+  for (size_t i = 0, w = 0; i < unique.count; ++i) {
+    if (sym_get(&unique, i) == WORD_BREAK)
+      w++;
+    else
+      total += freqs.items[w];
+  }
+  symbols_free(&unique);
+  free(freqs.items);
+  return bpe_trained(bpe, stop, (String_View){0}, total, next_token, result);
+}
+
+Bpe_Status bpe_training_tokens(const Bpe *bpe, uint32_t *tokens,
+                               size_t capacity, size_t *count) {
+  if (!bpe->keep_tokens)
+    return BPE_ERROR_STATE;
+  *count = bpe->trained.count;
+  if (capacity < bpe->trained.count)
+    return BPE_ERROR_BUFFER;
+  for (size_t i = 0; i < bpe->trained.count; ++i) {
+    tokens[i] = bpe->trained.items[i];
+  }
+  return BPE_OK;
+}
+
+Bpe_Status bpe_save(const Bpe *bpe, const char *path) {
+  if (!bpe->ready)
+    return BPE_ERROR_STATE;
+  // The file as it is in memory, either the mapping or the one just built
+  String_Builder file = bpe->built;
+  if (bpe->model.mapping)
+    file = (String_Builder){
+        .items = bpe->model.mapping,
+        .count = bpe->model.mapping_size,
+    };
+  return write_file((char *)path, &file) ? BPE_OK : BPE_ERROR_IO;
+}
+
+Bpe_Status bpe_save_merges(const Bpe *bpe, const char *path) {
+  if (!bpe->ready)
+    return BPE_ERROR_STATE;
+  return model_save_text((char *)path, &bpe->model) ? BPE_OK : BPE_ERROR_IO;
+}
+
+Bpe_Status bpe_load(Bpe *bpe, const char *path) {
+  bpe_unload(bpe);
+  bpe->merges.count = 0;
+  bpe->trained.count = 0;
+  if (!model_load((char *)path, &bpe->model))
+    return BPE_ERROR_IO;
+  bpe_ready(bpe);
+  return BPE_OK;
+}
+
+Bpe_Status bpe_info(const Bpe *bpe, Bpe_Info *info) {
+  if (!bpe->ready)
+    return BPE_ERROR_STATE;
+  const Model *m = &bpe->model;
+  *info = (Bpe_Info){
+      .vocab_size = m->vocab_count + m->special_count,
+      .merges = m->merge_count,
+      .specials = m->special_count,
+      .vocab_bytes = m->offsets[m->vocab_count + m->special_count],
+  };
+  return BPE_OK;
+}
+
+Bpe_Status bpe_encode(Bpe *bpe, const char *text, size_t size,
+                      uint32_t *tokens, size_t capacity, size_t *count) {
+  if (!bpe->ready)
+    return BPE_ERROR_STATE;
+  if (!text && size > 0)
+    return BPE_ERROR_ARGUMENT;
+
+  // No token is shorter than a byte, so with room for one per byte the
+  // caller's buffer never has to grow and is written in place
+  String_View sv = sv_from_parts(text, size);
+  if (capacity >= size) {
+    Tokens out = {.items = (int *)tokens, .capacity = capacity};
+    encode(&bpe->encoder, &bpe->scratch, sv, bpe->cfg.words, &out);
+    CHAOS_ASSERT(out.items == (int *)tokens);
+    *count = out.count;
+    return BPE_OK;
+  }
+
+  bpe->tokens.count = 0;
+  encode(&bpe->encoder, &bpe->scratch, sv, bpe->cfg.words, &bpe->tokens);
+  *count = bpe->tokens.count;
+  if (capacity < bpe->tokens.count)
+    return BPE_ERROR_BUFFER;
+  memcpy(tokens, bpe->tokens.items, bpe->tokens.count * sizeof(*tokens));
+  return BPE_OK;
+}
+
+Bpe_Status bpe_encode_batch(Bpe *bpe, const Bpe_View *docs, size_t count,
+                            uint32_t *tokens, size_t capacity, size_t *offsets,
+                            size_t *total) {
+  if (!bpe->ready)
+    return BPE_ERROR_STATE;
+
+  bpe->views.count = 0;
+  da_reserve(&bpe->views, count);
+  for (size_t d = 0; d < count; ++d) {
+    if (!docs[d].data && docs[d].count > 0)
+      return BPE_ERROR_ARGUMENT;
+    bpe->views.items[bpe->views.count++] =
+        sv_from_parts(docs[d].data, docs[d].count);
+  }
+
+  Batch *b = &bpe->batch;
+  encode_batch(b, bpe->views.items, count);
+  memcpy(offsets, b->offsets.items, (count + 1) * sizeof(*offsets));
+  *total = b->offsets.items[count];
+  if (capacity < *total)
+    return BPE_ERROR_BUFFER;
+  batch_gather(b, (int *)tokens);
+  return BPE_OK;
+}
+
+Bpe_Status bpe_decode(const Bpe *bpe, const uint32_t *tokens, size_t count,
+                      char *out, size_t capacity, size_t *size) {
+  if (!bpe->ready)
+    return BPE_ERROR_STATE;
+  Decoder d = decoder_of_model((Model *)&bpe->model);
+  size_t bad = SIZE_MAX;
+  *size = decode_tokens(&d, (const int *)tokens, count, out, capacity, &bad);
+  if (bad != SIZE_MAX) {
+    *size = bad;
+    return BPE_ERROR_ARGUMENT;
+  }
+  return *size <= capacity ? BPE_OK : BPE_ERROR_BUFFER;
+}
+
+void bpe_cache_stats(const Bpe *bpe, Bpe_Cache_Stats *stats) {
+  Cache total = {0};
+  if (bpe->ready) {
+    cache_add(&total, &bpe->scratch.cache);
+    for (size_t k = 0; k < bpe->batch.threads; ++k) {
+      cache_add(&total, &bpe->batch.workers[k].scratch.cache);
+    }
+  }
+  *stats = (Bpe_Cache_Stats){
+      .hits = total.hits,
+      .misses = total.misses,
+      .evictions = total.evictions,
+  };
+}
+
+const char *bpe_status_name(Bpe_Status status) {
+  return status_names[status];
+}
+
+const char *bpe_stop_name(Bpe_Stop stop) {
+  return stop_names[stop];
+}